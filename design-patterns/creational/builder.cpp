@@ -13,108 +13,1107 @@
 #include <vector>
 #include <iostream>
 #include <string>
+#include <cstdint>
+#include <cctype>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <string_view>
+#include <initializer_list>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-class CacheKey {
+// wyhash (final version 4): 64-bit hash built on a 64x64->128 bit multiply-and-fold
+// - reads the input 16 bytes at a time (48 on long inputs), inputs up to 16 bytes in 1-2 loads
+// - passes SMHasher; the seed separates hash domains, e.g. query names from header names
+// link: https://github.com/wangyi-fudan/wyhash
+class WyHash {
+public:
+    static uint64_t mix(uint64_t a, uint64_t b) {
+        __uint128_t r = static_cast<__uint128_t>(a) * b;
+        return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+    }
+
+    static uint64_t hash(const void *key, size_t len, uint64_t seed) {
+        const uint8_t *p = static_cast<const uint8_t*>(key);
+        seed ^= mix(seed ^ kSecret[0], kSecret[1]);
+        uint64_t a, b;
+        if (len <= 16) {
+            if (len >= 4) {
+                a = (r4(p) << 32) | r4(p + ((len >> 3) << 2));
+                b = (r4(p + len - 4) << 32) | r4(p + len - 4 - ((len >> 3) << 2));
+            } else if (len > 0) {
+                a = r3(p, len);
+                b = 0;
+            } else {
+                a = b = 0;
+            }
+        } else {
+            size_t i = len;
+            if (i > 48) {
+                uint64_t see1 = seed, see2 = seed;
+                do {
+                    seed = mix(r8(p) ^ kSecret[1], r8(p + 8) ^ seed);
+                    see1 = mix(r8(p + 16) ^ kSecret[2], r8(p + 24) ^ see1);
+                    see2 = mix(r8(p + 32) ^ kSecret[3], r8(p + 40) ^ see2);
+                    p += 48;
+                    i -= 48;
+                } while (i > 48);
+                seed ^= see1 ^ see2;
+            }
+            while (i > 16) {
+                seed = mix(r8(p) ^ kSecret[1], r8(p + 8) ^ seed);
+                i -= 16;
+                p += 16;
+            }
+            a = r8(p + i - 16);
+            b = r8(p + i - 8);
+        }
+        a ^= kSecret[1];
+        b ^= seed;
+        __uint128_t r = static_cast<__uint128_t>(a) * b;
+        return mix(static_cast<uint64_t>(r) ^ kSecret[0] ^ len, static_cast<uint64_t>(r >> 64) ^ kSecret[1]);
+    }
+
+    static uint64_t hash(const std::string &s, uint64_t seed) {
+        return hash(s.data(), s.size(), seed);
+    }
+
+private:
+    static constexpr uint64_t kSecret[4] = {0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+                                            0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL};
+
+    static uint64_t r8(const uint8_t *p) {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        return v;
+    }
+
+    static uint64_t r4(const uint8_t *p) {
+        uint32_t v;
+        std::memcpy(&v, p, 4);
+        return v;
+    }
+
+    static uint64_t r3(const uint8_t *p, size_t k) {
+        return (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[k >> 1]) << 8) | p[k - 1];
+    }
+};
+
+// bump allocator over caller provided memory, e.g. a per request or per worker buffer
+// - keys are allocated from the front and never freed one by one: reset() drops everything at once
+// - builders take their scratch space from the back (LIFO), so a finished key leaves no scratch behind
+// - nothing here touches the heap; running out of room is reported as nullptr
+class KeyArena {
 public:
-    CacheKey(std::string ns, std::string path):
-        ns_(ns),
-        path_(path),
-        immutable_(false)
+    KeyArena(char *base, size_t capacity):
+        base_(base),
+        front_(base),
+        back_(base + capacity),
+        end_(base + capacity)
         {}
 
-    void set_ns(std::string ns) {
-        ns_ = ns;
+    char* allocate(size_t len, size_t align) {
+        char *p = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(front_) + align - 1) & ~(align - 1));
+        if (p > back_ || static_cast<size_t>(back_ - p) < len) {
+            return nullptr;
+        }
+        front_ = p + len;
+        return p;
     }
 
-    void set_path(std::string path) {
-        path_ = path;
+    char* allocate_scratch(size_t len) {
+        if (static_cast<size_t>(back_ - front_) < len) {
+            return nullptr;
+        }
+        back_ -= len;
+        return back_;
     }
-    
-    void add_query(std::string key, std::string val) {
-        if (immutable_) {
-            return;
+
+    char* scratch_mark() const {
+        return back_;
+    }
+
+    // drops the scratch allocated since mark was taken
+    void release_scratch(char *mark) {
+        back_ = mark;
+    }
+
+    void reset() {
+        front_ = base_;
+        back_ = end_;
+    }
+
+    size_t used() const {
+        return (front_ - base_) + (end_ - back_);
+    }
+
+private:
+    char *base_;
+    char *front_;
+    char *back_;
+    char *end_;
+};
+
+// arena with its buffer inline, e.g. on the stack of a request handler
+// not copyable or movable: the base's pointers point into this object's own buffer_
+template <size_t N>
+class InlineKeyArena: public KeyArena {
+public:
+    InlineKeyArena(): KeyArena(buffer_, N) {}
+
+    InlineKeyArena(const InlineKeyArena &) = delete;
+    InlineKeyArena& operator=(const InlineKeyArena &) = delete;
+    InlineKeyArena(InlineKeyArena &&) = delete;
+    InlineKeyArena& operator=(InlineKeyArena &&) = delete;
+
+private:
+    alignas(8) char buffer_[N];
+};
+
+// finds, in one pass, the bytes a request line parser stops at: ' ' ? & = % + # : CR LF
+// - with SSE2, 16 bytes are compared against every delimiter at once and the hits kept as a bitmask;
+//   next() pops the lowest bit and only loads the next block once the mask is empty
+// - without SSE2, and for the last partial block, a lookup table builds the same mask a byte at a time
+class DelimiterScanner {
+public:
+    DelimiterScanner(const char *begin, const char *end):
+        base_(begin),
+        next_(begin),
+        end_(end),
+        mask_(0)
+        {}
+
+    // continues the scan at pos, skipping whatever delimiters lie before it
+    void seek(const char *pos) {
+        next_ = pos;
+        mask_ = 0;
+    }
+
+    // position of the next delimiter, end if there is none
+    const char* next() {
+        while (mask_ == 0) {
+            if (next_ >= end_) {
+                return end_;
+            }
+            base_ = next_;
+            mask_ = (end_ - next_ >= 16) ? block_mask(next_) : scalar_mask(next_, end_ - next_);
+            next_ += 16;
         }
-        query_map_[key] = val;
+        unsigned bit = __builtin_ctz(mask_);
+        mask_ &= mask_ - 1;
+        return base_ + bit;
     }
 
-    void add_header(std::string key, std::string val) {
-        if (immutable_) {
-            return;
+private:
+    const char *base_; // block mask_ refers to
+    const char *next_; // block to load next
+    const char *end_;
+    uint32_t mask_;
+
+    static bool is_delimiter(unsigned char c) {
+        static const struct Table {
+            bool hit[256];
+            Table(): hit() {
+                for (char c: std::string_view(" ?&=%+#:\r\n")) {
+                    hit[static_cast<unsigned char>(c)] = true;
+                }
+            }
+        } table;
+        return table.hit[c];
+    }
+
+    static uint32_t scalar_mask(const char *p, size_t len) {
+        uint32_t mask = 0;
+        for (size_t i = 0; i < len && i < 16; i++) {
+            mask |= static_cast<uint32_t>(is_delimiter(p[i])) << i;
+        }
+        return mask;
+    }
+
+#if defined(__SSE2__)
+    static uint32_t block_mask(const char *p) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('?'))),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')), _mm_cmpeq_epi8(v, _mm_set1_epi8('=')))),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('%')), _mm_cmpeq_epi8(v, _mm_set1_epi8('+'))),
+                         _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('#')), _mm_cmpeq_epi8(v, _mm_set1_epi8(':'))),
+                                      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))))));
+        return static_cast<uint32_t>(_mm_movemask_epi8(hits));
+    }
+#else
+    static uint32_t block_mask(const char *p) {
+        return scalar_mask(p, 16);
+    }
+#endif
+};
+
+// perfect hash set of names, compiled once: every name owns a slot of a power of two table, so a
+// lookup is one hash, one slot and one compare, and never probes
+// - compile() drops repeated names (equal after folding, for a case insensitive set): two equal names
+//   share a slot under every seed
+// - it then tries seeds until no two names share a slot, doubling the table every 64 failed seeds, and
+//   gives up after kMaxDoublings doublings, leaving the set empty
+// - a case insensitive set folds ASCII letters in both the hash and the compare
+class PerfectHashSet {
+public:
+    PerfectHashSet(): seed_(0), mask_(0), fold_(false), slots_(1, -1) {}
+
+    // returns -1 if no seed was found; find() then matches nothing
+    template <class It>
+    int compile(It begin, It end, bool fold_case) {
+        fold_ = fold_case;
+        names_.clear();
+        std::unordered_set<std::string> seen;
+        for (It it = begin; it != end; ++it) {
+            std::string name(*it);
+            std::string folded(name);
+            for (char &c: folded) {
+                c = fold_ ? static_cast<char>(fold(c)) : c;
+            }
+            if (seen.insert(std::move(folded)).second) {
+                names_.push_back(std::move(name));
+            }
+        }
+        size_t size = 1;
+        while (size < 2 * names_.size()) {
+            size <<= 1;
+        }
+        for (uint64_t attempt = 0; attempt < 64 * (kMaxDoublings + 1); attempt++) {
+            if (attempt > 0 && attempt % 64 == 0) {
+                size <<= 1;
+            }
+            mask_ = size - 1;
+            seed_ = WyHash::mix(attempt + 1, 0x9e3779b97f4a7c15ULL);
+            slots_.assign(size, -1);
+            bool collided = false;
+            for (size_t i = 0; i < names_.size() && !collided; i++) {
+                int &slot = slots_[hash(names_[i]) & mask_];
+                collided = (slot >= 0);
+                slot = i;
+            }
+            if (!collided) {
+                return 0;
+            }
+        }
+        names_.clear();
+        mask_ = 0;
+        slots_.assign(1, -1);
+        return -1;
+    }
+
+    // index of name in the compiled list (repeats dropped), -1 if it is not in the set
+    int find(std::string_view name) const {
+        int i = slots_[hash(name) & mask_];
+        return (i >= 0 && equals(names_[i], name)) ? i : -1;
+    }
+
+    size_t size() const {
+        return names_.size();
+    }
+
+private:
+    static const unsigned kMaxDoublings = 8;
+
+    std::vector<std::string> names_;
+    uint64_t seed_;
+    uint64_t mask_;
+    bool fold_;
+    std::vector<int> slots_;
+
+    static unsigned char fold(unsigned char c) {
+        return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+    }
+
+    uint64_t hash(std::string_view name) const {
+        uint64_t h = 0xcbf29ce484222325ULL ^ name.size();
+        for (unsigned char c: name) {
+            h = (h ^ (fold_ ? fold(c) : c)) * 0x100000001b3ULL;
+        }
+        return WyHash::mix(h, seed_);
+    }
+
+    bool equals(std::string_view a, std::string_view b) const {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); i++) {
+            if (a[i] != b[i] && (!fold_ || fold(a[i]) != fold(b[i]))) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// which query params and headers of a request make it into the key (Vary style), compiled once
+// - queries: names are case sensitive; "*" keeps every query param
+// - headers: names are case insensitive; no headers are kept unless listed
+// - a name listed twice counts once; rules whose names could not be compiled are not valid()
+class KeyRules {
+public:
+    KeyRules(std::initializer_list<std::string_view> queries = {"*"}, std::initializer_list<std::string_view> headers = {}):
+        all_queries_(false)
+    {
+        for (auto name: queries) {
+            all_queries_ = all_queries_ || name == "*";
+        }
+        valid_ = queries_.compile(queries.begin(), queries.end(), false) == 0
+            && headers_.compile(headers.begin(), headers.end(), true) == 0;
+    }
+
+    bool valid() const {
+        return valid_;
+    }
+
+    bool allows_query(std::string_view name) const {
+        return all_queries_ || queries_.find(name) >= 0;
+    }
+
+    bool allows_header(std::string_view name) const {
+        return headers_.find(name) >= 0;
+    }
+
+private:
+    bool all_queries_;
+    bool valid_;
+    PerfectHashSet queries_;
+    PerfectHashSet headers_;
+};
+
+// key rules per namespace, looked up through a perfect hash of the namespaces (case insensitive, like
+// host names); namespaces without rules of their own get the default rules
+class KeyRuleSet {
+public:
+    KeyRuleSet(KeyRules default_rules = KeyRules()): default_(default_rules) {}
+
+    // configuration time: adding a new namespace recompiles the namespace index, adding one again
+    // replaces its rules; -1 for invalid rules or a namespace index that does not compile
+    int add(std::string_view ns, KeyRules rules) {
+        if (!rules.valid()) {
+            return -1;
+        }
+        int i = index_.find(ns);
+        if (i >= 0) {
+            rules_[i] = rules;
+            return 0;
         }
-        header_map_[key] = val;
+        namespaces_.emplace_back(ns);
+        rules_.push_back(rules);
+        if (index_.compile(namespaces_.begin(), namespaces_.end(), true) != 0) {
+            namespaces_.pop_back();
+            rules_.pop_back();
+            index_.compile(namespaces_.begin(), namespaces_.end(), true);
+            return -1;
+        }
+        return 0;
+    }
+
+    const KeyRules& rules_for(std::string_view ns) const {
+        int i = index_.find(ns);
+        return (i >= 0) ? rules_[i] : default_;
+    }
+
+private:
+    KeyRules default_;
+    std::vector<std::string> namespaces_;
+    std::vector<KeyRules> rules_;
+    PerfectHashSet index_;
+};
+
+// flat, immutable cache key: one contiguous blob in an arena
+// - layout: this header | one Field per query and header, sorted by (kind, name) | the bytes of ns,
+//   path and every name and value; fields refer to their bytes by offset from the start of the blob
+// - the field order is canonical and overwritten values are gone, so equal keys are equal blobs, byte
+//   for byte, and the blob can be copied anywhere with memcpy
+// - accessors hand out string_views into the blob, lookups by name are binary searches
+// - only CacheKeyBuilder creates keys, and a key cannot be copied field by field
+// the hash is built up as the key is built:
+// - ns and path each keep their own hash, replaced when they are set again
+// - every query and header pair is hashed on its own (the name seeds the value's hash, so "ab"="c" and
+//   "a"="bc" differ) and pairs are summed per kind; a sum does not depend on insertion order, and
+//   replacing a value subtracts the old pair's hash before adding the new one
+// - the parts are folded together once, when the key is built, and stored in the header
+class CacheKey {
+public:
+    CacheKey(const CacheKey &) = delete;
+    CacheKey& operator=(const CacheKey &) = delete;
+
+    std::string_view ns() const {
+        return std::string_view(bytes() + sizeof(CacheKey) + field_count() * sizeof(Field), ns_len_);
     }
 
-    void set_immutable() {
-        immutable_ = true;
+    std::string_view path() const {
+        return std::string_view(ns().data() + ns_len_, path_len_);
+    }
+
+    size_t query_count() const {
+        return query_count_;
+    }
+
+    std::string_view query_name(size_t i) const {
+        return view(fields()[i].name_off, fields()[i].name_len);
+    }
+
+    std::string_view query_value(size_t i) const {
+        return view(fields()[i].val_off, fields()[i].val_len);
+    }
+
+    size_t header_count() const {
+        return header_count_;
+    }
+
+    std::string_view header_name(size_t i) const {
+        return query_name(query_count_ + i);
+    }
+
+    std::string_view header_value(size_t i) const {
+        return query_value(query_count_ + i);
+    }
+
+    // returns -1 if the key has no such query
+    int find_query(std::string_view name, std::string_view &value) const {
+        return find(fields(), fields() + query_count_, name, value);
+    }
+
+    int find_header(std::string_view name, std::string_view &value) const {
+        return find(fields() + query_count_, fields() + field_count(), name, value);
     }
 
     uint64_t get_hash() const {
-        return ((ns_.length() + path_.length()) % 1024);
+        return hash_;
+    }
+
+    // the whole blob
+    const char* data() const {
+        return bytes();
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    friend bool operator==(const CacheKey &a, const CacheKey &b) {
+        return a.hash_ == b.hash_ && a.size_ == b.size_ && std::memcmp(a.bytes(), b.bytes(), a.size_) == 0;
+    }
+
+    friend bool operator!=(const CacheKey &a, const CacheKey &b) {
+        return !(a == b);
     }
 
     friend std::ostream& operator<<(std::ostream& os, const CacheKey& cache_key); 
 
+    // parses a raw request (request line plus headers) into a key built in arena, see parse_request()
+    // returns nullptr for a malformed request or a full arena
+    static const CacheKey* from_request(KeyArena &arena, std::string_view request,
+                                        std::initializer_list<std::string_view> headers = {}) {
+        CacheKeyBuilder builder(arena);
+        return builder.parse_request(request, headers.begin(), headers.size()).get_cache_key();
+    }
+
+    // same, with the query params and headers picked by the rules of the request's namespace
+    static const CacheKey* from_request(KeyArena &arena, std::string_view request, const KeyRuleSet &rules) {
+        CacheKeyBuilder builder(arena, &rules);
+        return builder.parse_request(request).get_cache_key();
+    }
+
+    // writes one key into an arena, without touching the heap
+    // - setters copy their arguments into arena scratch, so temporaries may be passed in
+    // - get_cache_key() lays the blob out at the front of the arena and gives the scratch back; it
+    //   returns nullptr if the arena ran out of room or the key has more than kMaxFields fields
+    // - one builder per key; builders sharing an arena must finish in LIFO order
+    // - with a KeyRuleSet, query params and headers the namespace's rules do not allow are dropped as
+    //   they are added, before they are copied or hashed; fields added before the ns are filtered when
+    //   the key is built
     class CacheKeyBuilder {
     public:
-        CacheKeyBuilder() {
-            cache_key_ = new CacheKey("", "");
+        static const size_t kMaxFields = 32;
+
+        CacheKeyBuilder(KeyArena &arena, const KeyRuleSet *rule_set = nullptr):
+            arena_(arena),
+            mark_(arena.scratch_mark()),
+            rule_set_(rule_set),
+            rules_(nullptr),
+            unfiltered_(false),
+            field_count_(0),
+            failed_(false),
+            ns_hash_(WyHash::hash("", 0, kNsSeed)),
+            path_hash_(WyHash::hash("", 0, kPathSeed)),
+            sums_{0, 0},
+            counts_{0, 0}
+            {}
+
+        ~CacheKeyBuilder() {
+            arena_.release_scratch(mark_);
         }
 
-        CacheKeyBuilder set_ns(std::string ns) {
-            cache_key_->set_ns(ns);
+        CacheKeyBuilder(const CacheKeyBuilder &) = delete;
+        CacheKeyBuilder& operator=(const CacheKeyBuilder &) = delete;
+
+        CacheKeyBuilder& set_ns(std::string_view ns) {
+            put_ns(copy(ns));
             return *this;
         }
 
-        CacheKeyBuilder set_path(std::string path) {
-            cache_key_->set_path(path);
+        CacheKeyBuilder& set_path(std::string_view path) {
+            put_path(copy(path));
             return *this;
         }
 
-        CacheKeyBuilder add_query(std::string key, std::string val) {
-            cache_key_->add_query(key, val);
+        CacheKeyBuilder& add_query(std::string_view key, std::string_view val) {
+            add_field(QUERY, key, val);
             return *this;
         }
 
-        CacheKeyBuilder add_header(std::string key, std::string val) {
-            cache_key_->add_header(key, val);
+        CacheKeyBuilder& add_header(std::string_view key, std::string_view val) {
+            add_field(HEADER, key, val);
             return *this;
         }
 
-        CacheKey* get_cache_key() {
-            cache_key_->set_immutable();
-            return cache_key_;
+        // fills the key from a raw request: "GET /path?query HTTP/1.1\r\nHost: ...\r\n...\r\n"
+        // - one pass over the request with DelimiterScanner; the bytes between delimiters are only
+        //   touched again if they need decoding
+        // - ns is the host, from an absolute form target ("GET http://host/path") or else the Host header,
+        //   lowercased
+        // - path: escapes of unreserved characters are decoded and the others get uppercase hex, so
+        //   equivalent spellings of a path give one key (RFC 3986 6.2.2)
+        // - query parameters are split on & and =, fully decoded ('+' is a space) and kept sorted by name,
+        //   the last value of a repeated name wins; the fragment is dropped
+        // - of the headers, only names in headers[0 .. header_count) are kept (matched case insensitively,
+        //   stored lowercased), with their values trimmed
+        // - with a KeyRuleSet, its rules pick the query params and headers instead; the Host header is
+        //   looked up first (line starts only) so the rules are known before any field is seen
+        // a malformed request makes get_cache_key() return nullptr
+        CacheKeyBuilder& parse_request(std::string_view request, const std::string_view *headers, size_t header_count) {
+            enum State {
+                METHOD,
+                PATH,
+                QUERY_NAME,
+                QUERY_VALUE,
+                FRAGMENT,
+                VERSION,
+                HEADER_NAME,
+                DONE
+            };
+            const char *end = request.data() + request.size();
+            const char *mark = request.data(); // start of the current token
+            const char *pos = mark;
+            bool escaped = false;              // a '%' or '+' since mark
+            bool host_known = rule_set_ && find_host(request);
+            bool skip_value = false;           // query value of a name the rules drop
+            std::string_view name;
+            State state = METHOD;
+            DelimiterScanner scanner(mark, end);
+            while (!failed_ && state != DONE && (pos = scanner.next()) != end) {
+                if (pos < mark) {
+                    continue; // inside a token consumed out of band (absolute form authority)
+                }
+                char c = *pos;
+                switch (state) {
+                case METHOD:
+                    if (c != ' ' || pos == mark) {
+                        failed_ = true;
+                        break;
+                    }
+                    mark = pos + 1;
+                    host_known = parse_authority(mark, end) || host_known;
+                    state = PATH;
+                    break;
+                case PATH:
+                    if (c == '%') {
+                        escaped = true;
+                    } else if (c == '?' || c == '#' || c == ' ') {
+                        std::string_view path(mark, pos - mark);
+                        put_path(escaped ? normalize_path(path) : copy(path.empty() ? "/" : path));
+                        state = (c == '?') ? QUERY_NAME : (c == '#') ? FRAGMENT : VERSION;
+                        mark = pos + 1;
+                        escaped = false;
+                    } else if (c == '\r' || c == '\n') {
+                        failed_ = true;
+                    }
+                    break;
+                case QUERY_NAME:
+                case QUERY_VALUE:
+                    if (c == '%' || c == '+') {
+                        escaped = true;
+                    } else if (c == '=' && state == QUERY_NAME) {
+                        name = decode(std::string_view(mark, pos - mark), escaped);
+                        skip_value = rules_ && !rules_->allows_query(name);
+                        state = QUERY_VALUE;
+                        mark = pos + 1;
+                        escaped = false;
+                    } else if (c == '&' || c == '#' || c == ' ') {
+                        std::string_view token = std::string_view(mark, pos - mark);
+                        if (state == QUERY_VALUE) {
+                            if (!skip_value) {
+                                add_field(QUERY, name, decode(token, escaped));
+                            }
+                        } else if (!token.empty()) {
+                            add_field(QUERY, decode(token, escaped), std::string_view()); // "?flag"
+                        }
+                        state = (c == '&') ? QUERY_NAME : (c == '#') ? FRAGMENT : VERSION;
+                        mark = pos + 1;
+                        escaped = false;
+                    } else if (c == '\r' || c == '\n') {
+                        failed_ = true;
+                    }
+                    break;
+                case FRAGMENT:
+                    if (c == ' ') {
+                        state = VERSION;
+                        mark = pos + 1;
+                    } else if (c == '\r' || c == '\n') {
+                        failed_ = true;
+                    }
+                    break;
+                case VERSION:
+                    if (c == '\n') {
+                        failed_ = !is_version(trim(std::string_view(mark, pos - mark)));
+                        state = HEADER_NAME;
+                        mark = pos + 1;
+                    } else if (c != '\r') {
+                        failed_ = true;
+                    }
+                    break;
+                case HEADER_NAME:
+                    if (c == ':') {
+                        // a value only ends at the line end: memchr finds it without stopping at its delimiters
+                        name = std::string_view(mark, pos - mark);
+                        const char *eol = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+                        mark = eol ? eol + 1 : end;
+                        std::string_view value = trim(std::string_view(pos + 1, (eol ? eol : end) - pos - 1));
+                        if (equals_lower(name, "host")) {
+                            if (!host_known) {
+                                put_ns(lower(value));
+                            }
+                        } else if (rules_ ? rules_->allows_header(name) : is_selected(name, headers, header_count)) {
+                            add_field(HEADER, lower(name), copy(value));
+                        }
+                        scanner.seek(mark);
+                    } else if (c == '\n') {
+                        // only the blank line ending the headers has no ':'
+                        failed_ = !trim(std::string_view(mark, pos - mark)).empty();
+                        state = DONE;
+                    }
+                    break;
+                case DONE:
+                    break;
+                }
+            }
+            // a request may stop after the request line or after a header line, without the blank line
+            if (!failed_ && state == VERSION) {
+                failed_ = !is_version(trim(std::string_view(mark, end - mark)));
+            } else if (!failed_ && state != DONE && !(state == HEADER_NAME && mark == end)) {
+                failed_ = true;
+            }
+            return *this;
+        }
+
+        CacheKeyBuilder& parse_request(std::string_view request, std::initializer_list<std::string_view> headers = {}) {
+            return parse_request(request, headers.begin(), headers.size());
+        }
+
+        const CacheKey* get_cache_key() {
+            if (failed_) {
+                return nullptr;
+            }
+            if (unfiltered_) {
+                drop_disallowed(rule_set_->rules_for(ns_));
+            }
+            std::sort(pending_, pending_ + field_count_, [](const Pending &a, const Pending &b) {
+                return a.kind != b.kind ? a.kind < b.kind : a.name < b.name;
+            });
+            size_t size = sizeof(CacheKey) + field_count_ * sizeof(Field) + ns_.size() + path_.size();
+            for (size_t i = 0; i < field_count_; i++) {
+                size += pending_[i].name.size() + pending_[i].val.size();
+            }
+            char *blob = arena_.allocate(size, alignof(CacheKey));
+            if (!blob || size > UINT32_MAX) {
+                failed_ = true;
+                return nullptr;
+            }
+
+            CacheKey *key = new (blob) CacheKey(size, counts_[QUERY], counts_[HEADER], ns_.size(), path_.size(),
+                                                fold_hash(ns_hash_, path_hash_, sums_, counts_));
+            Field *fields = reinterpret_cast<Field*>(blob + sizeof(CacheKey));
+            char *out = reinterpret_cast<char*>(fields + field_count_);
+            out = std::copy(ns_.begin(), ns_.end(), out);
+            out = std::copy(path_.begin(), path_.end(), out);
+            for (size_t i = 0; i < field_count_; i++) {
+                fields[i].name_off = out - blob;
+                fields[i].name_len = pending_[i].name.size();
+                out = std::copy(pending_[i].name.begin(), pending_[i].name.end(), out);
+                fields[i].val_off = out - blob;
+                fields[i].val_len = pending_[i].val.size();
+                out = std::copy(pending_[i].val.begin(), pending_[i].val.end(), out);
+            }
+            arena_.release_scratch(mark_);
+            failed_ = true; // built: the scratch views are gone
+            return key;
         }
 
     private:
-        CacheKey *cache_key_;
+        enum Kind {
+            QUERY = 0,
+            HEADER = 1
+        };
+
+        // a field as added, its bytes still in scratch
+        struct Pending {
+            Kind kind;
+            std::string_view name;
+            std::string_view val;
+        };
+
+        KeyArena &arena_;
+        char *mark_; // scratch in use by this builder starts below this
+        const KeyRuleSet *rule_set_;
+        const KeyRules *rules_; // rules of the current ns, once it is set
+        bool unfiltered_;       // fields were added before the rules were known
+        Pending pending_[kMaxFields];
+        size_t field_count_;
+        bool failed_;
+        std::string_view ns_;
+        std::string_view path_;
+        uint64_t ns_hash_;
+        uint64_t path_hash_;
+        uint64_t sums_[2];   // per kind
+        uint32_t counts_[2]; // per kind
+
+        void put_ns(std::string_view ns) {
+            ns_ = ns;
+            ns_hash_ = WyHash::hash(ns.data(), ns.size(), kNsSeed);
+            if (rule_set_) {
+                rules_ = &rule_set_->rules_for(ns);
+            }
+        }
+
+        void put_path(std::string_view path) {
+            path_ = path;
+            path_hash_ = WyHash::hash(path.data(), path.size(), kPathSeed);
+        }
+
+        bool in_scratch(std::string_view s) const {
+            uintptr_t p = reinterpret_cast<uintptr_t>(s.data());
+            return p >= reinterpret_cast<uintptr_t>(arena_.scratch_mark()) &&
+                p + s.size() <= reinterpret_cast<uintptr_t>(mark_);
+        }
+
+        // s as a view into this builder's scratch; bytes already there are not copied again
+        std::string_view copy(std::string_view s) {
+            if (s.empty() || in_scratch(s)) {
+                return s;
+            }
+            char *p = arena_.allocate_scratch(s.size());
+            if (!p) {
+                failed_ = true;
+                return std::string_view();
+            }
+            std::copy(s.begin(), s.end(), p);
+            return std::string_view(p, s.size());
+        }
+
+        static bool allows(const KeyRules &rules, Kind kind, std::string_view name) {
+            return (kind == QUERY) ? rules.allows_query(name) : rules.allows_header(name);
+        }
+
+        void add_field(Kind kind, std::string_view name, std::string_view val) {
+            if (rules_ && !allows(*rules_, kind, name)) {
+                return;
+            }
+            unfiltered_ = unfiltered_ || (rule_set_ && !rules_);
+            uint64_t seed = (kind == QUERY) ? kQuerySeed : kHeaderSeed;
+            for (size_t i = 0; i < field_count_; i++) {
+                if (pending_[i].kind == kind && pending_[i].name == name) {
+                    sums_[kind] -= pair_hash(seed, pending_[i].name, pending_[i].val);
+                    pending_[i].val = copy(val);
+                    sums_[kind] += pair_hash(seed, name, val);
+                    return;
+                }
+            }
+            if (field_count_ == kMaxFields) {
+                failed_ = true;
+                return;
+            }
+            pending_[field_count_++] = Pending{kind, copy(name), copy(val)};
+            counts_[kind]++;
+            sums_[kind] += pair_hash(seed, name, val);
+        }
+
+        void drop_disallowed(const KeyRules &rules) {
+            size_t kept = 0;
+            for (size_t i = 0; i < field_count_; i++) {
+                Pending &field = pending_[i];
+                if (allows(rules, field.kind, field.name)) {
+                    pending_[kept++] = field;
+                } else {
+                    sums_[field.kind] -= pair_hash((field.kind == QUERY) ? kQuerySeed : kHeaderSeed, field.name, field.val);
+                    counts_[field.kind]--;
+                }
+            }
+            field_count_ = kept;
+        }
+
+        // ns from the Host header, ahead of the main pass; false for an absolute form target, whose
+        // authority comes before any field anyway, or a request without a Host header
+        bool find_host(std::string_view request) {
+            size_t eol = request.find('\n');
+            size_t target = request.find(' ');
+            if (eol == std::string_view::npos || target > eol ||
+                request.compare(target + 1, 7, "http://") == 0 || request.compare(target + 1, 8, "https://") == 0) {
+                return false;
+            }
+            for (size_t line = eol + 1; line < request.size(); line = eol + 1) {
+                eol = request.find('\n', line);
+                if (eol == std::string_view::npos) {
+                    eol = request.size();
+                }
+                std::string_view header = request.substr(line, eol - line);
+                if (trim(header).empty()) {
+                    return false;
+                }
+                if (header.size() >= 5 && equals_lower(header.substr(0, 5), "host:")) {
+                    put_ns(lower(trim(header.substr(5))));
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static int hex_value(char c) {
+            if (c >= '0' && c <= '9') {
+                return c - '0';
+            }
+            c |= 0x20;
+            return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        }
+
+        static bool is_unreserved(unsigned char c) {
+            return std::isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+        }
+
+        static std::string_view trim(std::string_view s) {
+            while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+                s.remove_prefix(1);
+            }
+            while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r')) {
+                s.remove_suffix(1);
+            }
+            return s;
+        }
+
+        static bool equals_lower(std::string_view s, std::string_view lower) {
+            if (s.size() != lower.size()) {
+                return false;
+            }
+            for (size_t i = 0; i < s.size(); i++) {
+                if (std::tolower(static_cast<unsigned char>(s[i])) != lower[i]) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        static bool is_selected(std::string_view name, const std::string_view *headers, size_t header_count) {
+            for (size_t i = 0; i < header_count; i++) {
+                if (name.size() == headers[i].size()) {
+                    size_t j = 0;
+                    while (j < name.size() && std::tolower(static_cast<unsigned char>(name[j])) ==
+                           std::tolower(static_cast<unsigned char>(headers[i][j]))) {
+                        j++;
+                    }
+                    if (j == name.size()) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        static bool is_version(std::string_view version) {
+            return version.size() > 5 && version.compare(0, 5, "HTTP/") == 0;
+        }
+
+        // an absolute form target ("http://host/path"): sets ns from the authority and moves target to
+        // the path; returns whether the target had a host
+        bool parse_authority(const char *&target, const char *end) {
+            std::string_view rest(target, end - target);
+            size_t scheme = (rest.compare(0, 7, "http://") == 0) ? 7 : (rest.compare(0, 8, "https://") == 0) ? 8 : 0;
+            if (scheme == 0) {
+                return false;
+            }
+            size_t host_end = rest.find_first_of("/? ", scheme);
+            if (host_end == std::string_view::npos) {
+                host_end = rest.size();
+            }
+            put_ns(lower(rest.substr(scheme, host_end - scheme)));
+            target += host_end;
+            return true;
+        }
+
+        std::string_view lower(std::string_view s) {
+            char *p = arena_.allocate_scratch(s.size());
+            if (!p) {
+                failed_ = true;
+                return std::string_view();
+            }
+            for (size_t i = 0; i < s.size(); i++) {
+                p[i] = std::tolower(static_cast<unsigned char>(s[i]));
+            }
+            return std::string_view(p, s.size());
+        }
+
+        // query component: %XX and '+' decoded; a broken escape is kept as is
+        // a component without escapes comes back as is, add_field() copies it if the key keeps it
+        std::string_view decode(std::string_view s, bool escaped) {
+            if (!escaped) {
+                return s;
+            }
+            char *p = arena_.allocate_scratch(s.size()); // decoding never grows
+            if (!p) {
+                failed_ = true;
+                return std::string_view();
+            }
+            size_t len = 0;
+            for (size_t i = 0; i < s.size(); i++) {
+                int hi, lo;
+                if (s[i] == '%' && i + 2 < s.size() && (hi = hex_value(s[i + 1])) >= 0 &&
+                    (lo = hex_value(s[i + 2])) >= 0) {
+                    p[len++] = static_cast<char>(hi << 4 | lo);
+                    i += 2;
+                } else {
+                    p[len++] = (s[i] == '+') ? ' ' : s[i];
+                }
+            }
+            return std::string_view(p, len);
+        }
+
+        // path: escapes of unreserved characters decoded, every other escape with uppercase hex
+        std::string_view normalize_path(std::string_view s) {
+            char *p = arena_.allocate_scratch(s.size());
+            if (!p) {
+                failed_ = true;
+                return std::string_view();
+            }
+            size_t len = 0;
+            for (size_t i = 0; i < s.size(); i++) {
+                int hi, lo;
+                if (s[i] == '%' && i + 2 < s.size() && (hi = hex_value(s[i + 1])) >= 0 &&
+                    (lo = hex_value(s[i + 2])) >= 0) {
+                    char decoded = static_cast<char>(hi << 4 | lo);
+                    if (is_unreserved(static_cast<unsigned char>(decoded))) {
+                        p[len++] = decoded;
+                    } else {
+                        p[len++] = '%';
+                        p[len++] = std::toupper(static_cast<unsigned char>(s[i + 1]));
+                        p[len++] = std::toupper(static_cast<unsigned char>(s[i + 2]));
+                    }
+                    i += 2;
+                } else {
+                    p[len++] = s[i];
+                }
+            }
+            return std::string_view(p, len);
+        }
     };
 
 private:
-    std::string ns_;
-    std::string path_;
-    std::unordered_map<std::string, std::string> query_map_;
-    std::unordered_map<std::string, std::string> header_map_;
-    bool immutable_; // once set to true, no changes can be made
+    struct Field {
+        uint32_t name_off;
+        uint32_t name_len;
+        uint32_t val_off;
+        uint32_t val_len;
+    };
+
+    // distinct seeds keep the parts apart: ns "a" with path "b" is not ns "b" with path "a"
+    static const uint64_t kNsSeed = 0x6e73;
+    static const uint64_t kPathSeed = 0x70617468;
+    static const uint64_t kQuerySeed = 0x7175657279;
+    static const uint64_t kHeaderSeed = 0x686561646572;
+
+    // no padding anywhere: equal keys compare equal with memcmp
+    uint64_t hash_;
+    uint32_t size_; // whole blob
+    uint16_t query_count_;
+    uint16_t header_count_;
+    uint32_t ns_len_;
+    uint32_t path_len_;
+
+    CacheKey(size_t size, size_t query_count, size_t header_count, size_t ns_len, size_t path_len, uint64_t hash):
+        hash_(hash),
+        size_(size),
+        query_count_(query_count),
+        header_count_(header_count),
+        ns_len_(ns_len),
+        path_len_(path_len)
+        {}
+
+    const char* bytes() const {
+        return reinterpret_cast<const char*>(this);
+    }
+
+    size_t field_count() const {
+        return query_count_ + header_count_;
+    }
+
+    const Field* fields() const {
+        return reinterpret_cast<const Field*>(bytes() + sizeof(CacheKey));
+    }
+
+    std::string_view view(uint32_t off, uint32_t len) const {
+        return std::string_view(bytes() + off, len);
+    }
+
+    int find(const Field *begin, const Field *end, std::string_view name, std::string_view &value) const {
+        const Field *it = std::lower_bound(begin, end, name, [this](const Field &field, std::string_view name) {
+            return view(field.name_off, field.name_len) < name;
+        });
+        if (it == end || view(it->name_off, it->name_len) != name) {
+            return -1;
+        }
+        value = view(it->val_off, it->val_len);
+        return 0;
+    }
+
+    static uint64_t pair_hash(uint64_t seed, std::string_view key, std::string_view val) {
+        return WyHash::hash(val.data(), val.size(), WyHash::hash(key.data(), key.size(), seed));
+    }
+
+    static uint64_t fold_hash(uint64_t ns_hash, uint64_t path_hash, const uint64_t sums[2], const uint32_t counts[2]) {
+        // the field counts go in too, so keys whose pair hashes happen to sum alike still need equal counts
+        uint64_t parts = WyHash::mix(ns_hash ^ path_hash * 0x9e3779b97f4a7c15ULL, path_hash ^ 0xa0761d6478bd642fULL);
+        uint64_t pairs = WyHash::mix(sums[0] ^ (static_cast<uint64_t>(counts[0]) << 32 | counts[1]),
+                                     sums[1] ^ 0xe7037ed1a0b428dbULL);
+        return WyHash::mix(parts ^ 0x8ebc6af09c88c6e3ULL, pairs ^ 0x589965cc75374cc3ULL);
+    }
 };
 
 std::ostream& operator<<(std::ostream& os, const CacheKey& cache_key) {
     os << "CacheKey: Begin" << std::endl
-        << " ns: " << cache_key.ns_ << std::endl
-        << " path: " << cache_key.path_ << std::endl
-        << " immutable_: " << cache_key.immutable_ << std::endl;
+        << " ns: " << cache_key.ns() << std::endl
+        << " path: " << cache_key.path() << std::endl
+        << " size: " << cache_key.size() << " bytes" << std::endl;
     
-    if (cache_key.query_map_.size()) {
+    if (cache_key.query_count()) {
         os << " query params: ";
-        for (auto q: cache_key.query_map_) {
-            os << " " << q.first << " = " << q.second << "; ";
+        for (size_t i = 0; i < cache_key.query_count(); i++) {
+            os << " " << cache_key.query_name(i) << " = " << cache_key.query_value(i) << "; ";
         }
     }
 
-    if (cache_key.header_map_.size()) {
+    if (cache_key.header_count()) {
         os << std::endl << " headers: ";
-        for (auto hdr: cache_key.header_map_) {
-            os << " " << hdr.first << " = " << hdr.second << "; ";
+        for (size_t i = 0; i < cache_key.header_count(); i++) {
+            os << " " << cache_key.header_name(i) << " = " << cache_key.header_value(i) << "; ";
         }
     }
 
@@ -126,10 +1125,207 @@ std::ostream& operator<<(std::ostream& os, const CacheKey& cache_key) {
     return os;
 }
 
+class KeyInternTable;
+
+// a reference to an interned key: equal keys interned in one table have equal ids, so comparing and
+// hashing handles is integer work
+// - copies share the reference; the entry is reclaimed when the last handle to it goes away
+// - ids are never reused, so an id kept after its key was reclaimed cannot name another key
+// - a default constructed handle is empty: id() 0, valid() false
+class InternedKey {
+public:
+    InternedKey(): table_(nullptr), entry_(nullptr) {}
+    InternedKey(const InternedKey &other);
+    InternedKey(InternedKey &&other): table_(other.table_), entry_(other.entry_) {
+        other.table_ = nullptr;
+        other.entry_ = nullptr;
+    }
+    InternedKey& operator=(InternedKey other) {
+        std::swap(table_, other.table_);
+        std::swap(entry_, other.entry_);
+        return *this;
+    }
+    ~InternedKey();
+
+    bool valid() const {
+        return entry_ != nullptr;
+    }
+
+    uint64_t id() const;
+    const CacheKey& key() const;
+
+    friend bool operator==(const InternedKey &a, const InternedKey &b) {
+        return a.id() == b.id();
+    }
+
+    friend bool operator!=(const InternedKey &a, const InternedKey &b) {
+        return !(a == b);
+    }
+
+private:
+    friend class KeyInternTable;
+    struct Entry;
+
+    KeyInternTable *table_;
+    Entry *entry_;
+
+    InternedKey(KeyInternTable *table, Entry *entry): table_(table), entry_(entry) {}
+};
+
+namespace std {
+template <>
+struct hash<InternedKey> {
+    size_t operator()(const InternedKey &key) const {
+        return WyHash::mix(key.id(), 0x9e3779b97f4a7c15ULL);
+    }
+};
+}
+
+// the interned copy of a key: the blob is copied as is, it has no pointers into its old arena
+struct InternedKey::Entry {
+    uint64_t id;
+    std::atomic<uint32_t> refs;
+    std::unique_ptr<uint64_t[]> blob; // 8 byte aligned, like the arena blob
+
+    Entry(uint64_t id, const CacheKey &key): id(id), refs(0), blob(new uint64_t[(key.size() + 7) / 8]) {
+        std::memcpy(blob.get(), key.data(), key.size());
+    }
+
+    const CacheKey& key() const {
+        return *reinterpret_cast<const CacheKey*>(blob.get());
+    }
+};
+
+// concurrent intern table: one copy of every distinct key in use, each with a stable 64-bit id
+// - sharded by key hash; a lookup takes its shard's lock shared, and only inserting a new key or
+//   reclaiming one takes it exclusively
+// - entries are refcounted by their handles; the handle that drops the count to 0 reclaims the entry
+//   under the shard lock, unless an intern() revived it in the meantime (a revival also runs under
+//   the shard lock, shared, so the reclaimer sees it)
+// - interning a key already in the table copies nothing and does not touch the heap
+class KeyInternTable {
+public:
+    static const size_t kShards = 64;
+
+    KeyInternTable(): next_id_(1), size_(0) {}
+
+    ~KeyInternTable() {
+        // handles must not outlive the table
+        for (auto &shard: shards_) {
+            for (auto &entry: shard.entries) {
+                delete entry.second;
+            }
+        }
+    }
+
+    KeyInternTable(const KeyInternTable &) = delete;
+    KeyInternTable& operator=(const KeyInternTable &) = delete;
+
+    InternedKey intern(const CacheKey &key) {
+        Shard &shard = shard_for(key.get_hash());
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            if (InternedKey::Entry *entry = find(shard, key)) {
+                entry->refs.fetch_add(1, std::memory_order_relaxed);
+                return InternedKey(this, entry);
+            }
+        }
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        InternedKey::Entry *entry = find(shard, key); // interned by another thread meanwhile
+        if (!entry) {
+            entry = new InternedKey::Entry(next_id_.fetch_add(1, std::memory_order_relaxed), key);
+            shard.entries.emplace(key.get_hash(), entry);
+            size_.fetch_add(1, std::memory_order_relaxed);
+        }
+        entry->refs.fetch_add(1, std::memory_order_relaxed);
+        return InternedKey(this, entry);
+    }
+
+    // number of distinct keys held
+    size_t size() const {
+        return size_.load(std::memory_order_relaxed);
+    }
+
+private:
+    friend class InternedKey;
+
+    struct Shard {
+        std::shared_mutex mutex;
+        std::unordered_multimap<uint64_t, InternedKey::Entry*> entries; // by key hash
+    };
+
+    Shard shards_[kShards];
+    std::atomic<uint64_t> next_id_;
+    std::atomic<size_t> size_;
+
+    Shard& shard_for(uint64_t hash) {
+        return shards_[hash >> 58]; // kShards = 2^6: top bits, the low ones pick the buckets
+    }
+
+    static InternedKey::Entry* find(Shard &shard, const CacheKey &key);
+
+    void release(InternedKey::Entry *entry);
+};
+
+inline InternedKey::Entry* KeyInternTable::find(Shard &shard, const CacheKey &key) {
+    auto range = shard.entries.equal_range(key.get_hash());
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second->key() == key) {
+            return it->second;
+        }
+    }
+    return nullptr;
+}
+
+inline void KeyInternTable::release(InternedKey::Entry *entry) {
+    // once the count is dropped the entry may be revived, or revived and reclaimed by another handle,
+    // until the lock is held: read what is needed first, then look it up again by id
+    uint64_t id = entry->id;
+    uint64_t hash = entry->key().get_hash();
+    if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+    Shard &shard = shard_for(hash);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto range = shard.entries.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second->id == id) {
+            if (it->second->refs.load(std::memory_order_acquire) == 0) {
+                delete it->second;
+                shard.entries.erase(it);
+                size_.fetch_sub(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+    }
+}
+
+inline InternedKey::InternedKey(const InternedKey &other): table_(other.table_), entry_(other.entry_) {
+    if (entry_) {
+        entry_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+inline InternedKey::~InternedKey() {
+    if (entry_) {
+        table_->release(entry_);
+    }
+}
+
+inline uint64_t InternedKey::id() const {
+    return entry_ ? entry_->id : 0;
+}
+
+inline const CacheKey& InternedKey::key() const {
+    return entry_->key();
+}
+
 int main()
 {   
-    CacheKey::CacheKeyBuilder key_builder;
-    CacheKey *cache_key_00 = key_builder.set_ns("www.runforyourlife.com")
+    // keys of one request live in one arena; nothing is allocated on the heap to build them
+    InlineKeyArena<2048> arena;
+    CacheKey::CacheKeyBuilder key_builder(arena);
+    const CacheKey *cache_key_00 = key_builder.set_ns("www.runforyourlife.com")
                                 .set_path("images/")
                                 .add_query("jpeg", "1")
                                 .add_query("wide", "1")
@@ -138,6 +1334,73 @@ int main()
                                 .get_cache_key();
 
     std::cout << *cache_key_00 << std::endl;
+
+    // same key, queries and headers added in another order: same blob, same hash
+    CacheKey::CacheKeyBuilder key_builder_01(arena);
+    const CacheKey *cache_key_01 = key_builder_01.set_ns("www.runforyourlife.com")
+                                .set_path("images/")
+                                .add_header("mobile", "0")
+                                .add_query("wide", "1")
+                                .add_header("stale", "ok")
+                                .add_query("jpeg", "1")
+                                .get_cache_key();
+    // a different key of the same length: a different hash
+    CacheKey::CacheKeyBuilder key_builder_02(arena);
+    const CacheKey *cache_key_02 = key_builder_02.set_ns("www.runforyourlife.com")
+                                .set_path("videos/")
+                                .get_cache_key();
+    std::string_view stale;
+    cache_key_01->find_header("stale", stale);
+    std::cout << "order independent: " << (*cache_key_00 == *cache_key_01 && cache_key_00->get_hash() == cache_key_01->get_hash())
+        << ", same length keys differ: " << (cache_key_01->get_hash() != cache_key_02->get_hash())
+        << ", stale = " << stale << ", arena used = " << arena.used() << " bytes" << std::endl;
+
+    // straight from the wire: equivalent spellings of one request give one key
+    const CacheKey *parsed = CacheKey::from_request(arena,
+        "GET /images/%7euser/cat%2fdog.jpg?wide=1&jpeg=%31#top HTTP/1.1\r\n"
+        "Host: WWW.RunForYourLife.com\r\n"
+        "Accept-Encoding: gzip\r\n"
+        "User-Agent: curl/8.0\r\n"
+        "\r\n", {"accept-encoding"});
+    const CacheKey *parsed_too = CacheKey::from_request(arena,
+        "GET http://www.runforyourlife.com/images/~user/cat%2Fdog.jpg?jpeg=1&wide=1 HTTP/1.1\r\n"
+        "accept-encoding:   gzip\r\n"
+        "\r\n", {"accept-encoding"});
+    std::cout << *parsed << std::endl
+        << "parsed keys equal: " << (parsed_too && *parsed == *parsed_too) << std::endl;
+
+    // per namespace key rules: tracking params and headers outside the rules do not split the cache
+    KeyRuleSet rules;
+    rules.add("www.runforyourlife.com", KeyRules({"w", "h"}, {"Accept-Encoding"}));
+    const CacheKey *campaign = CacheKey::from_request(arena,
+        "GET /images/cat.jpg?w=640&utm_source=mail&h=480 HTTP/1.1\r\n"
+        "Host: www.runforyourlife.com\r\nUser-Agent: curl/8.0\r\nAccept-Encoding: br\r\n\r\n", rules);
+    const CacheKey *direct = CacheKey::from_request(arena,
+        "GET /images/cat.jpg?h=480&w=640 HTTP/1.1\r\n"
+        "accept-encoding: br\r\nHost: www.runforyourlife.com\r\nCookie: id=42\r\n\r\n", rules);
+    std::cout << "rules: campaign and direct requests share a key: " << (campaign && direct && *campaign == *direct)
+        << " (" << campaign->query_count() << " query params, " << campaign->header_count() << " header)" << std::endl;
+
+    // names listed twice (headers compare case insensitively) count once, and adding a namespace again
+    // replaces its rules
+    KeyRules repeated({"w", "w"}, {"Accept-Encoding", "accept-encoding"});
+    int readded = rules.add("WWW.runforyourlife.com", KeyRules({"w"}, {}));
+    const CacheKey *narrowed = CacheKey::from_request(arena,
+        "GET /images/cat.jpg?w=640&h=480 HTTP/1.1\r\nHost: www.runforyourlife.com\r\nAccept-Encoding: br\r\n\r\n", rules);
+    std::cout << "rules: repeated names compile: " << repeated.valid() << ", re-added namespace: " << (readded == 0)
+        << " (" << narrowed->query_count() << " query param, " << narrowed->header_count() << " headers)" << std::endl;
+
+    // interned keys: one stored copy per distinct key, compared by id; the copy goes with its last handle
+    KeyInternTable interned;
+    {
+        InternedKey id_00 = interned.intern(*cache_key_00);
+        InternedKey id_01 = interned.intern(*cache_key_01);
+        InternedKey id_02 = interned.intern(*cache_key_02);
+        std::cout << "interned: ids " << id_00.id() << ", " << id_01.id() << ", " << id_02.id()
+            << ", equal keys share an id: " << (id_00 == id_01) << ", distinct keys held = " << interned.size() << std::endl;
+    }
+    std::cout << "interned: distinct keys held after the handles are gone = " << interned.size() << std::endl;
+
+    arena.reset(); // request done: all of its keys go at once
     return 0;
 }
-
@@ -4,159 +4,4339 @@
 // link: https://www.geeksforgeeks.org/facade-design-pattern-introduction/
 //
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <iterator>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// how long a cached object may be served, as wall clock deadlines (ms since epoch, 0 = forever)
+// - until expires_at_ms the object is fresh
+// - until stale_until_ms it may still be served while a refresh runs in the background
+// - after that it is dead and must not be served
+struct Freshness {
+    int64_t expires_at_ms;
+    int64_t stale_until_ms;
+
+    enum State {
+        FRESH,
+        STALE,
+        DEAD
+    };
+
+    static Freshness forever() {
+        return Freshness{0, 0};
+    }
+
+    static Freshness ttl(std::chrono::milliseconds ttl, std::chrono::milliseconds grace) {
+        int64_t expires_at = now_ms() + ttl.count();
+        return Freshness{expires_at, expires_at + grace.count()};
+    }
+
+    State state(int64_t now) const {
+        if (expires_at_ms == 0 || now < expires_at_ms) {
+            return FRESH;
+        }
+        return now < stale_until_ms ? STALE : DEAD;
+    }
+};
+
+// immutable object bytes shared by reference: a cache hit hands out another reference, not a copy
+// the object's freshness travels with its bytes through every tier
+// the bytes are either owned by the buffer, or live in memory owned by whoever created the handle
+// (e.g. a slab chunk), in which case the handle's deleter gives that memory back
+class Buffer {
+private:
+    const std::vector<char> bytes_;
+    const char *data_;
+    size_t size_;
+    const Freshness freshness_;
+public:
+    explicit Buffer(std::vector<char> bytes, Freshness freshness = Freshness::forever()):
+        bytes_(std::move(bytes)),
+        data_(bytes_.data()),
+        size_(bytes_.size()),
+        freshness_(freshness)
+        {}
+
+    Buffer(const char *data, size_t size, Freshness freshness):
+        data_(data),
+        size_(size),
+        freshness_(freshness)
+        {}
+
+    const Freshness& freshness() const {
+        return freshness_;
+    }
+
+    const char* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    std::string_view view() const {
+        return std::string_view(data_, size_);
+    }
+};
+
+using BufferHandle = std::shared_ptr<const Buffer>;
+
+inline BufferHandle make_buffer(std::vector<char> bytes, Freshness freshness = Freshness::forever()) {
+    return std::make_shared<const Buffer>(std::move(bytes), freshness);
+}
+
 class ICache {
 public:
+    virtual ~ICache() {}
     virtual int store(std::string key, std::vector<char> bytes) = 0;
     virtual int fetch(std::string key, std::vector<char> & bytes) = 0;
     virtual size_t get_capacity() = 0;
     virtual size_t get_size() = 0; // current size - sum total of objs cached
+
+    // zero copy flavor of store/fetch: payloads travel as refcounted immutable buffers
+    // the defaults adapt to store/fetch (and copy); tiers that keep buffers override them
+    virtual int store_buffer(std::string_view key, BufferHandle buffer) {
+        return store(std::string(key), std::vector<char>(buffer->data(), buffer->data() + buffer->size()));
+    }
+
+    virtual int fetch_buffer(std::string_view key, BufferHandle & buffer) {
+        std::vector<char> bytes;
+        int res = fetch(std::string(key), bytes);
+        if (res == 0) {
+            buffer = make_buffer(std::move(bytes));
+        }
+        return res;
+    }
+
+    // batched flavor: buffers[i] belongs to keys[i], a miss leaves a null handle
+    // returns the number of keys fetched (stored); the defaults loop, tiers override to batch for real
+    virtual size_t fetch_many(const std::vector<std::string_view> &keys, std::vector<BufferHandle> &buffers) {
+        buffers.assign(keys.size(), nullptr);
+        size_t hits = 0;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (fetch_buffer(keys[i], buffers[i]) == 0) {
+                hits++;
+            }
+        }
+        return hits;
+    }
+
+    virtual size_t store_many(const std::vector<std::string_view> &keys, const std::vector<BufferHandle> &buffers) {
+        size_t stored = 0;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (store_buffer(keys[i], buffers[i]) == 0) {
+                stored++;
+            }
+        }
+        return stored;
+    }
 };
 
-class HotObjectCache: public ICache {
+// memcached style slab allocator for hot tier values
+// - memory is mapped in pages of page_size_ bytes; a page belongs to one size class and is carved into
+//   equal chunks of that class, lazily, so untouched chunks cost no rss
+// - size classes grow by kGrowthFactor from kMinChunk up to a whole page; a value takes the smallest
+//   chunk it fits in, a value larger than a page gets a mapping of its own (the "large" class)
+// - a page whose chunks are all free again is unmapped right away: memory moves between classes one
+//   page at a time (S3FifoShard decides which class gives up a page)
+// - a page can also be handed over: drain_page() stops allocations from it, and once its last chunk
+//   is released it is carved again for the receiving class, without going back to the os
+// - committed() is what the values cost in rss, internal fragmentation included
+// - release() may run on any thread: the last reference to a buffer can be dropped anywhere
+class SlabAllocator {
+private:
+    static const size_t kMinChunk = 64;
+    static constexpr double kGrowthFactor = 1.25;
+    static const size_t kOsPage = 4096;
+
+    struct Page {
+        char *base;
+        size_t cls;
+        size_t live;    // chunks handed out
+        size_t carved;  // chunks handed out at least once
+        std::vector<char*> free;
+        bool available; // listed in its class's available list
+        bool draining;  // handed over to class to once empty, allocations skip it meanwhile
+        size_t to;
+        std::list<Page*>::iterator pos;
+    };
+
+    struct SizeClass {
+        size_t chunk_size;
+        size_t chunks_per_page;
+        size_t pages;
+        std::list<Page*> available; // pages with a free or never carved chunk
+    };
+
+    size_t page_size_; // power of two, pages are aligned to it
+    std::vector<SizeClass> classes_;
+    std::unordered_map<uintptr_t, Page*> pages_; // page base -> page
+    size_t committed_;
+    mutable std::mutex mutex_;
+
+    static size_t round_up(size_t n, size_t to) {
+        return (n + to - 1) / to * to;
+    }
+
+    // an mmap aligned to its size: map twice the size, trim both ends
+    char* map_page() {
+        void *addr = ::mmap(nullptr, 2 * page_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            return nullptr;
+        }
+        uintptr_t raw = reinterpret_cast<uintptr_t>(addr);
+        uintptr_t base = round_up(raw, page_size_);
+        if (base > raw) {
+            ::munmap(addr, base - raw);
+        }
+        ::munmap(reinterpret_cast<void*>(base + page_size_), raw + page_size_ - base);
+        return reinterpret_cast<char*>(base);
+    }
+
+    char* allocate_large(size_t size) {
+        size_t len = round_up(std::max<size_t>(size, 1), kOsPage);
+        void *addr = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            return nullptr;
+        }
+        committed_ += len;
+        return static_cast<char*>(addr);
+    }
+
+    // a chunk from the first available page of the class, which must have one
+    char* carve(SizeClass &sc) {
+        Page *page = sc.available.front();
+        char *chunk;
+        if (!page->free.empty()) {
+            chunk = page->free.back();
+            page->free.pop_back();
+        } else {
+            chunk = page->base + page->carved++ * sc.chunk_size;
+        }
+        page->live++;
+        if (page->free.empty() && page->carved == sc.chunks_per_page) {
+            sc.available.erase(page->pos);
+            page->available = false;
+        }
+        return chunk;
+    }
+
+public:
+    SlabAllocator(size_t page_size): page_size_(page_size), committed_(0) {
+        for (double size = kMinChunk; ; size *= kGrowthFactor) {
+            size_t chunk_size = std::min(round_up(static_cast<size_t>(size), 8), page_size_);
+            if (classes_.empty() || chunk_size > classes_.back().chunk_size) {
+                classes_.push_back(SizeClass{chunk_size, page_size_ / chunk_size, 0, {}});
+            }
+            if (chunk_size == page_size_) {
+                break;
+            }
+        }
+    }
+
+    ~SlabAllocator() {
+        for (auto &entry: pages_) {
+            ::munmap(entry.second->base, page_size_);
+            delete entry.second;
+        }
+    }
+
+    // classes are 0 .. class_count() - 1, the last one is the large class
+    size_t class_count() const {
+        return classes_.size() + 1;
+    }
+
+    size_t class_for(size_t size) const {
+        size_t lo = 0;
+        size_t hi = classes_.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (classes_[mid].chunk_size < size) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo; // == classes_.size() for large values
+    }
+
+    // bytes committed() grows by if size bytes were allocated now: 0 if a chunk is ready, else a page
+    // (or the whole mapping of a large value)
+    size_t grow_cost(size_t size) const {
+        size_t cls = class_for(size);
+        if (cls == classes_.size()) {
+            return round_up(std::max<size_t>(size, 1), kOsPage);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        return classes_[cls].available.empty() ? page_size_ : 0;
+    }
+
+    char* allocate(size_t size) {
+        size_t cls = class_for(size);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (cls == classes_.size()) {
+            return allocate_large(size);
+        }
+        SizeClass &sc = classes_[cls];
+        if (sc.available.empty()) {
+            char *base = map_page();
+            if (!base) {
+                return nullptr;
+            }
+            Page *page = new Page{base, cls, 0, 0, {}, true, false, 0, {}};
+            page->pos = sc.available.insert(sc.available.end(), page);
+            pages_[reinterpret_cast<uintptr_t>(base)] = page;
+            sc.pages++;
+            committed_ += page_size_;
+        }
+        return carve(sc);
+    }
+
+    void release(char *chunk, size_t size) {
+        size_t cls = class_for(size);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (cls == classes_.size()) {
+            size_t len = round_up(std::max<size_t>(size, 1), kOsPage);
+            ::munmap(chunk, len);
+            committed_ -= len;
+            return;
+        }
+        Page *page = pages_[reinterpret_cast<uintptr_t>(chunk) & ~(page_size_ - 1)];
+        SizeClass &sc = classes_[page->cls];
+        page->live--;
+        if (page->live == 0 && page->draining && page->to < classes_.size()) {
+            sc.pages--;
+            page->cls = page->to;
+            page->carved = 0;
+            page->free.clear();
+            page->draining = false;
+            page->pos = classes_[page->cls].available.insert(classes_[page->cls].available.end(), page);
+            page->available = true;
+            classes_[page->cls].pages++;
+            return;
+        }
+        if (page->live == 0) {
+            if (page->available) {
+                sc.available.erase(page->pos);
+            }
+            pages_.erase(reinterpret_cast<uintptr_t>(page->base));
+            ::munmap(page->base, page_size_);
+            delete page;
+            sc.pages--;
+            committed_ -= page_size_;
+            return;
+        }
+        page->free.push_back(chunk);
+        if (!page->available && !page->draining) {
+            page->pos = sc.available.insert(sc.available.end(), page);
+            page->available = true;
+        }
+    }
+
+    size_t committed() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return committed_;
+    }
+
+    size_t page_size() const {
+        return page_size_;
+    }
+
+    // base of the page a (non large) chunk lies on
+    uintptr_t page_of(const char *chunk) const {
+        return reinterpret_cast<uintptr_t>(chunk) & ~(page_size_ - 1);
+    }
+
+    // no chunk is allocated from the page any more; once it is empty it goes to class to (or back to
+    // the os if to is the large class)
+    void drain_page(uintptr_t base, size_t to) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Page *page = pages_[base];
+        if (page->available) {
+            classes_[page->cls].available.erase(page->pos);
+            page->available = false;
+        }
+        page->draining = true;
+        page->to = to;
+    }
+
+    // undoes drain_page() of a page that still has chunks out
+    void cancel_drain(uintptr_t base) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = pages_.find(base);
+        if (it == pages_.end() || !it->second->draining) {
+            return; // already handed over
+        }
+        Page *page = it->second;
+        page->draining = false;
+        if (!page->free.empty() || page->carved < classes_[page->cls].chunks_per_page) {
+            page->pos = classes_[page->cls].available.insert(classes_[page->cls].available.end(), page);
+            page->available = true;
+        }
+    }
+
+    // a chunk of class cls from a page it already has, nullptr rather than mapping one
+    char* allocate_mapped(size_t cls) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (cls == classes_.size() || classes_[cls].available.empty()) {
+            return nullptr;
+        }
+        return carve(classes_[cls]);
+    }
+
+    // chunks of the page still handed out
+    size_t live_chunks(uintptr_t page) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = pages_.find(page);
+        return it == pages_.end() ? 0 : it->second->live;
+    }
+
+    // true if class cls has a chunk ready on a page other than those in gone
+    bool has_chunk(size_t cls, const std::vector<uintptr_t> &gone) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (Page *page: classes_[cls].available) {
+            if (std::find(gone.begin(), gone.end(), reinterpret_cast<uintptr_t>(page->base)) == gone.end()) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// epoch based reclamation for lock free readers
+// - a reader pins the current epoch on its thread's stripe for as long as it looks at shared memory;
+//   stripes sit on cache lines of their own, so readers on different cores write no common line
+// - a writer that unlinked memory calls synchronize(): it opens a new epoch and waits until no reader
+//   is pinned to the old one, after which nothing unlinked before the call can still be seen
+class EpochDomain {
+private:
+    static constexpr size_t kStripes = 64;
+
+    struct alignas(64) Counter {
+        std::atomic<int64_t> value{0};
+    };
+
+    std::atomic<uint64_t> epoch_{0};
+    Counter pinned_[2][kStripes];
+
+    static size_t stripe() {
+        static std::atomic<size_t> next{0};
+        thread_local size_t mine = next.fetch_add(1, std::memory_order_relaxed) % kStripes;
+        return mine;
+    }
+
+public:
+    class Guard {
+    private:
+        std::atomic<int64_t> *counter_;
+    public:
+        explicit Guard(EpochDomain &domain) {
+            size_t s = stripe();
+            for (;;) {
+                uint64_t epoch = domain.epoch_.load(std::memory_order_seq_cst);
+                counter_ = &domain.pinned_[epoch & 1][s].value;
+                counter_->fetch_add(1, std::memory_order_seq_cst);
+                // lost a race with synchronize(): pin the new epoch instead
+                if (domain.epoch_.load(std::memory_order_seq_cst) == epoch) {
+                    break;
+                }
+                counter_->fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+        ~Guard() {
+            counter_->fetch_sub(1, std::memory_order_release);
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    EpochDomain() = default;
+    EpochDomain(const EpochDomain&) = delete;
+    EpochDomain& operator=(const EpochDomain&) = delete;
+
+    // callers are serialized by the owner and must not be pinned themselves
+    void synchronize() {
+        uint64_t epoch = epoch_.fetch_add(1, std::memory_order_seq_cst);
+        for (size_t s = 0; s < kStripes; s++) {
+            while (pinned_[epoch & 1][s].value.load(std::memory_order_seq_cst) != 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+};
+
+// one shard of the in-memory tier: objects are kept in S3-FIFO order (small fifo, main fifo, ghost fifo)
+// - a new object enters the small fifo (~10% of its queue); one-hit wonders are evicted from there
+//   without ever disturbing the working set that lives in main
+// - an object hit again while in small, or re-stored shortly after being evicted (ghost hit), goes to main
+// - main is a fifo with reinsertion: an object with freq > 0 gets another lap instead of being evicted
+// - a hit only bumps freq; no list is reordered on the read path
+// - optional hooks: an admission policy may veto evicting a victim for a new object, and an evict
+//   listener receives a copy of every object pushed out (e.g. to demote it to a lower tier), so the
+//   victim's chunk is free as soon as the eviction is
+// - a store is planned before anything is unlinked: victims are set aside until the value is known to
+//   fit, and a veto or a shard with no room left puts them back; an overwritten value is only dropped
+//   once its replacement is in
+// values are copied into slab chunks; every slab class has its own small/main fifos, like memcached's
+// per class lru, so evicting for a value frees a chunk of the size it needs
+// - page rebalancing (automove): a class that keeps evicting while another class rarely does takes a
+//   page from that class instead, like memcached's slab_rebalance: one page of the donor is picked, its
+//   objects move to free chunks on the donor's other pages or are evicted, and the empty page is
+//   carved again for the class that needs it; eviction counters are halved every kAutomoveWindow
+//   evictions, so the balance follows the current mix of value sizes
+// fetch_buffer and contains are lock free and may run concurrently with anything, they find entries
+// through a read table of their own (see ReadTable); everything else needs exclusive access
+// get_size() is slab memory committed plus per entry bookkeeping, which tracks rss of the shard
+// link: https://blog.jasony.me/system/cache/2023/08/01/s3fifo
+class S3FifoShard {
 private:
+    enum Queue {
+        SMALL,
+        MAIN
+    };
+
+    // key, hash and buffer never change while the entry is reachable from the read table
+    struct Entry {
+        std::string key;
+        size_t hash;
+        BufferHandle buffer;
+        std::atomic<uint8_t> freq;
+        Queue queue;
+        size_t cls;
+
+        Entry(std::string key, BufferHandle buffer, Queue queue, size_t cls):
+            key(std::move(key)), hash(std::hash<std::string_view>()(this->key)), buffer(std::move(buffer)), freq(0),
+            queue(queue), cls(cls) {}
+
+        Entry(Entry &&other):
+            key(std::move(other.key)),
+            hash(other.hash),
+            buffer(std::move(other.buffer)),
+            freq(other.freq.load(std::memory_order_relaxed)),
+            queue(other.queue),
+            cls(other.cls) {}
+    };
+
+    // the lock free view of index_ that readers probe: open addressing over entry pointers, linear
+    // probing, at most 3/4 of the slots used (tombstones included) so every probe ends at an empty slot
+    // - writers publish an entry with a release store once it is built, and swap in a tombstone (or the
+    //   entry replacing it) when it is unlinked
+    // - a table that fills up is rebuilt into a new one; the old table, like every unlinked entry, is
+    //   freed by reclaim() once no reader can still see it
+    struct ReadTable {
+        size_t mask;
+        size_t used; // slots filled since the build, tombstones included; writer only
+        std::unique_ptr<std::atomic<Entry*>[]> slots;
+
+        explicit ReadTable(size_t size): mask(size - 1), used(0), slots(new std::atomic<Entry*>[size]) {
+            for (size_t i = 0; i < size; i++) {
+                slots[i].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    struct ClassFifo {
+        std::list<Entry> small; // front = newest
+        std::list<Entry> main;  // front = newest
+        size_t small_count = 0;
+        size_t count = 0;
+        uint64_t evictions = 0; // recent evictions of this class's objects, halved every window
+    };
+
+    static const uint8_t kMaxFreq = 3;
+    // bookkeeping per entry outside the slab: list node, index node, read table slots, buffer and its
+    // control block
+    static const size_t kEntryOverhead = sizeof(Entry) + 2 * sizeof(void*) + 64 + 3 * sizeof(void*) + sizeof(Buffer) + 32;
+    static const size_t kMinReadTable = 16;
+    static const uint64_t kAutomoveSlack = 64;   // evictions a class may be ahead before it takes pages
+    static const uint64_t kAutomoveWindow = 4096;
+
     size_t capacity_;
-    size_t size_;
+    size_t meta_; // bookkeeping bytes of resident entries
+    std::shared_ptr<SlabAllocator> slab_; // shared with the deleters of the buffers handed out
+    std::vector<ClassFifo> fifos_;        // per slab class
+    uint64_t evictions_;
+    // the writers' index; keys are views of Entry::key: list nodes never move (promotion splices them), and
+    // an entry leaves index_ before it is retired; lookups by string_view then need no temporary string
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+    std::atomic<ReadTable*> table_;
+    std::vector<std::unique_ptr<ReadTable>> tables_; // the current table last, retired ones before it
+    std::list<Entry> retired_; // unlinked entries readers may still be looking at
+    mutable EpochDomain epochs_;
+    // ghost fifo remembers keys recently evicted from small (keys only, no bytes)
+    std::list<std::string> ghost_;
+    std::unordered_map<std::string, std::list<std::string>::iterator> ghost_index_;
+    std::function<bool(const std::string &candidate, const std::string &victim)> admit_;
+    std::function<void(const std::string &key, BufferHandle buffer)> on_evict_;
+
+    // pages of about 1/16 of the shard, between 4KB and 1MB
+    static size_t page_size_for(size_t capacity) {
+        size_t page_size = 4096;
+        while (page_size < (1 << 20) && page_size * 2 <= capacity / 16) {
+            page_size *= 2;
+        }
+        return page_size;
+    }
+
+    static size_t entry_meta(const std::string &key) {
+        return kEntryOverhead + key.size(); // the key is held by the entry, index_ only views it
+    }
+
+    static Entry* tombstone() {
+        static Entry marker("", nullptr, SMALL, 0);
+        return &marker;
+    }
+
+    // the entry of key in the read table, nullptr if there is none; called with an epoch pinned
+    Entry* find_published(std::string_view key) const {
+        size_t hash = std::hash<std::string_view>()(key);
+        ReadTable *table = table_.load(std::memory_order_acquire);
+        for (size_t i = hash & table->mask; ; i = (i + 1) & table->mask) {
+            Entry *entry = table->slots[i].load(std::memory_order_acquire);
+            if (!entry) {
+                return nullptr;
+            }
+            if (entry != tombstone() && entry->hash == hash && entry->key == key) {
+                return entry;
+            }
+        }
+    }
+
+    void publish(Entry *entry) {
+        ReadTable *table = table_.load(std::memory_order_relaxed);
+        if ((table->used + 1) * 4 > (table->mask + 1) * 3) {
+            table = rebuild_read_table();
+        }
+        size_t i = entry->hash & table->mask;
+        Entry *slot;
+        while ((slot = table->slots[i].load(std::memory_order_relaxed)) != nullptr && slot != tombstone()) {
+            i = (i + 1) & table->mask;
+        }
+        if (!slot) {
+            table->used++;
+        }
+        table->slots[i].store(entry, std::memory_order_release);
+    }
+
+    // puts replacement (an entry of the same key, or a tombstone) in the slot of entry
+    void unpublish(Entry *entry, Entry *replacement) {
+        ReadTable *table = table_.load(std::memory_order_relaxed);
+        for (size_t i = entry->hash & table->mask; ; i = (i + 1) & table->mask) {
+            if (table->slots[i].load(std::memory_order_relaxed) == entry) {
+                table->slots[i].store(replacement, std::memory_order_release);
+                return;
+            }
+        }
+    }
+
+    // a table without tombstones, with room for the entries to double
+    ReadTable* rebuild_read_table() {
+        size_t size = kMinReadTable;
+        while (size < 4 * (index_.size() + 1)) {
+            size *= 2;
+        }
+        std::unique_ptr<ReadTable> table(new ReadTable(size));
+        for (auto &entry: index_) {
+            Entry *e = &*entry.second;
+            size_t i = e->hash & table->mask;
+            while (table->slots[i].load(std::memory_order_relaxed)) {
+                i = (i + 1) & table->mask;
+            }
+            table->slots[i].store(e, std::memory_order_relaxed);
+            table->used++;
+        }
+        table_.store(table.get(), std::memory_order_release);
+        tables_.push_back(std::move(table));
+        return tables_.back().get();
+    }
+
+    // frees what was unlinked from the read table once no reader can still see it; chunks of unlinked
+    // entries go back to the slab here, unless a reader kept a handle to them
+    void reclaim() {
+        if (retired_.empty() && tables_.size() == 1) {
+            return;
+        }
+        epochs_.synchronize();
+        retired_.clear();
+        tables_.erase(tables_.begin(), tables_.end() - 1);
+    }
+
+    void remember_ghost(const std::string &key) {
+        ghost_.push_front(key);
+        ghost_index_[key] = ghost_.begin();
+        // ghost tracks roughly as many keys as there are resident objects
+        while (ghost_.size() > index_.size() + 1) {
+            ghost_index_.erase(ghost_.back());
+            ghost_.pop_back();
+        }
+    }
+
+    struct PageFreed {
+        uintptr_t page;
+        size_t chunks;
+        size_t cls;
+    };
+
+    // victims picked for one store, set aside in doomed until the store commits
+    struct Plan {
+        std::list<Entry> doomed;  // in the order they were picked
+        const Entry *replaced = nullptr; // the entry the store overwrites
+        bool replaced_doomed = false;    // it reached a queue tail and was set aside with the victims
+        size_t meta = 0;          // entry_meta() given back
+        size_t large = 0;         // bytes of large mappings given back
+        std::vector<PageFreed> pages; // chunks given back per page, a handful at most
+        std::vector<std::list<Entry>::iterator> next; // per doomed entry, what followed it in its queue
+        std::vector<std::pair<uintptr_t, size_t>> drained; // pages being handed over, and to which class
+    };
+
+    void remove(std::list<Entry>::iterator it) {
+        ClassFifo &fifo = fifos_[it->cls];
+        fifo.count--;
+        if (it->queue == SMALL) {
+            fifo.small_count--;
+        }
+        meta_ -= entry_meta(it->key);
+        index_.erase(it->key);
+        unpublish(&*it, tombstone());
+        retired_.splice(retired_.end(), it->queue == SMALL ? fifo.small : fifo.main, it);
+    }
+
+    // what dropping entry frees; a chunk a reader still holds is not freed
+    void account(Plan &plan, const Entry &entry) {
+        plan.meta += entry_meta(entry.key);
+        if (entry.buffer.use_count() != 1) {
+            return;
+        }
+        if (entry.cls == fifos_.size() - 1) {
+            plan.large += slab_->grow_cost(entry.buffer->size());
+            return;
+        }
+        uintptr_t page = slab_->page_of(entry.buffer->data());
+        for (auto &freed: plan.pages) {
+            if (freed.page == page) {
+                freed.chunks++;
+                return;
+            }
+        }
+        plan.pages.push_back(PageFreed{page, 1, entry.cls});
+    }
+
+    // moves a queue tail into the plan; index_ still finds it until the plan commits
+    void doom(Plan &plan, std::list<Entry>::iterator it) {
+        ClassFifo &fifo = fifos_[it->cls];
+        fifo.count--;
+        if (it->queue == SMALL) {
+            fifo.small_count--;
+        }
+        if (&*it == plan.replaced) {
+            plan.replaced_doomed = true;
+        } else {
+            account(plan, *it);
+        }
+        plan.next.push_back(std::next(it));
+        plan.doomed.splice(plan.doomed.end(), it->queue == SMALL ? fifo.small : fifo.main, it);
+    }
+
+    // puts the doomed entries back where they were taken from, latest first, and takes back the pages
+    // offered for hand over
+    void restore(Plan &plan) {
+        while (!plan.doomed.empty()) {
+            auto it = std::prev(plan.doomed.end());
+            auto next = plan.next.back();
+            plan.next.pop_back();
+            ClassFifo &fifo = fifos_[it->cls];
+            // next may have been promoted into main since
+            if (next != fifo.small.end() && next != fifo.main.end()) {
+                it->queue = next->queue;
+            }
+            fifo.count++;
+            if (it->queue == SMALL) {
+                fifo.small_count++;
+            }
+            (it->queue == SMALL ? fifo.small : fifo.main).splice(next, plan.doomed, it);
+        }
+        for (auto &drained: plan.drained) {
+            slab_->cancel_drain(drained.first);
+        }
+        reclaim(); // entries replaced by migrated copies
+    }
+
+    BufferHandle slab_buffer(char *chunk, size_t size, const Freshness &freshness) {
+        std::shared_ptr<SlabAllocator> slab = slab_;
+        return BufferHandle(new Buffer(chunk, size, freshness), [slab](const Buffer *b) {
+            slab->release(const_cast<char*>(b->data()), b->size());
+            delete b;
+        });
+    }
+
+    // replaces the entry at it with a copy whose value lives in chunk; readers see one or the other
+    void migrate(Plan &plan, std::list<Entry>::iterator it, char *chunk) {
+        std::list<Entry> &list = it->queue == SMALL ? fifos_[it->cls].small : fifos_[it->cls].main;
+        std::memcpy(chunk, it->buffer->data(), it->buffer->size());
+        auto moved = list.emplace(it, it->key, slab_buffer(chunk, it->buffer->size(), it->buffer->freshness()), it->queue, it->cls);
+        moved->freq.store(it->freq.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        index_.erase(it->key);
+        index_[moved->key] = moved;
+        unpublish(&*it, &*moved);
+        std::replace(plan.next.begin(), plan.next.end(), it, moved); // restore() puts entries back before it
+        retired_.splice(retired_.end(), list, it);
+    }
+
+    // rebalancing step: sets aside the donor's page with the fewest objects for class cls (or, if cls
+    // takes no pages, for the os); its objects move to free chunks on the donor's other pages, where
+    // there are any, and are victims otherwise
+    // - only a page whose chunks are all held by objects no reader shares can empty out right away
+    // returns 0 if the donor has no such page with at most most objects, -1 if the admission policy
+    // vetoed a victim
+    int plan_page(Plan &plan, size_t donor, size_t cls, const std::string &candidate, size_t most) {
+        ClassFifo &fifo = fifos_[donor];
+        std::unordered_map<uintptr_t, size_t> objects; // page -> objects on it, SIZE_MAX if shared
+        for (auto *list: {&fifo.small, &fifo.main}) {
+            for (auto &entry: *list) {
+                size_t &n = objects[slab_->page_of(entry.buffer->data())];
+                n = (n == SIZE_MAX || entry.buffer.use_count() != 1) ? SIZE_MAX : n + 1;
+            }
+        }
+        uintptr_t page = 0;
+        size_t fewest = SIZE_MAX;
+        for (auto &candidate_page: objects) {
+            if (candidate_page.second < fewest && slab_->live_chunks(candidate_page.first) == candidate_page.second) {
+                page = candidate_page.first;
+                fewest = candidate_page.second;
+            }
+        }
+        if (fewest == SIZE_MAX || fewest > most) {
+            return 0;
+        }
+        size_t large = fifos_.size() - 1;
+        size_t to = (cls != large && plan.drained.empty()) ? cls : large;
+        slab_->drain_page(page, to);
+        plan.drained.emplace_back(page, to);
+
+        std::vector<std::list<Entry>::iterator> on_page;
+        for (auto *list: {&fifo.small, &fifo.main}) {
+            for (auto it = list->begin(); it != list->end(); ++it) {
+                if (slab_->page_of(it->buffer->data()) == page) {
+                    on_page.push_back(it);
+                }
+            }
+        }
+        for (auto it: on_page) {
+            if (&*it != plan.replaced) {
+                char *chunk = slab_->allocate_mapped(donor);
+                if (chunk) {
+                    migrate(plan, it, chunk);
+                    continue;
+                }
+                if (admit_ && !admit_(candidate, it->key)) {
+                    return -1;
+                }
+            }
+            doom(plan, it);
+        }
+        return 1;
+    }
+
+    // drops the doomed entries (and the replaced one); victims are remembered and handed to the listener
+    void commit(Plan &plan) {
+        for (auto &entry: plan.doomed) {
+            meta_ -= entry_meta(entry.key);
+            index_.erase(entry.key);
+            unpublish(&entry, tombstone());
+            if (&entry == plan.replaced) {
+                continue;
+            }
+            if (entry.queue == SMALL) {
+                remember_ghost(entry.key);
+            }
+            fifos_[entry.cls].evictions++;
+            if (++evictions_ % kAutomoveWindow == 0) {
+                for (auto &fifo: fifos_) {
+                    fifo.evictions /= 2;
+                }
+            }
+            if (on_evict_) {
+                const Buffer &b = *entry.buffer;
+                on_evict_(entry.key, make_buffer(std::vector<char>(b.data(), b.data() + b.size()), b.freshness()));
+            }
+        }
+        retired_.splice(retired_.end(), plan.doomed);
+        reclaim();
+    }
+
+    // one S3-FIFO step within a class: moves an object along, or picks the tail as a victim
+    // - an object accessed again while in small is promoted to main; one in main with freq > 0 gets
+    //   another lap
+    // returns false if the admission policy prefers keeping the victim over the candidate
+    bool plan_step(Plan &plan, size_t cls, const std::string &candidate) {
+        ClassFifo &fifo = fifos_[cls];
+        bool small = fifo.small_count > fifo.count / 10 || fifo.main.empty();
+        auto it = std::prev(small ? fifo.small.end() : fifo.main.end());
+        uint8_t freq = it->freq.load(std::memory_order_relaxed);
+        if (freq > 0) {
+            if (small) {
+                fifo.small_count--;
+                it->freq.store(0, std::memory_order_relaxed);
+                it->queue = MAIN;
+                fifo.main.splice(fifo.main.begin(), fifo.small, it);
+            } else {
+                it->freq.store(freq - 1, std::memory_order_relaxed);
+                fifo.main.splice(fifo.main.begin(), fifo.main, it);
+            }
+            return true;
+        }
+        if (&*it != plan.replaced && admit_ && !admit_(candidate, it->key)) {
+            return false;
+        }
+        doom(plan, it);
+        return true;
+    }
+
+    // the class to evict from to make room for a value of class cls: cls itself, unless it is empty or
+    // has evicted well beyond the least evicting class, which then gives up memory instead
+    // returns class_count() if no class has anything left
+    size_t victim_class(size_t cls) {
+        size_t donor = fifos_.size();
+        for (size_t c = 0; c < fifos_.size(); c++) {
+            if (c == cls || fifos_[c].count == 0) {
+                continue;
+            }
+            if (donor == fifos_.size() || fifos_[c].evictions < fifos_[donor].evictions) {
+                donor = c;
+            }
+        }
+        if (fifos_[cls].count == 0) {
+            return donor;
+        }
+        if (donor != fifos_.size() && fifos_[cls].evictions > fifos_[donor].evictions + kAutomoveSlack) {
+            return donor;
+        }
+        return cls;
+    }
+
+    // whether a value of size (class cls) and its bookkeeping fit once the plan commits; sets grows if
+    // the value then still needs memory mapped for it
+    bool fits(const Plan &plan, size_t size, size_t cls, size_t meta, bool &grows) const {
+        if (plan.pages.empty() && plan.large == 0) {
+            grows = slab_->grow_cost(size) != 0;
+            return slab_->committed() + meta_ - plan.meta + meta + slab_->grow_cost(size) <= capacity_;
+        }
+        size_t freed = plan.large;
+        bool chunk_freed = false;
+        std::vector<uintptr_t> gone;
+        for (auto &page: plan.pages) {
+            if (slab_->live_chunks(page.page) == page.chunks) {
+                gone.push_back(page.page);
+                auto drained = std::find_if(plan.drained.begin(), plan.drained.end(),
+                                            [&page](const std::pair<uintptr_t, size_t> &d) { return d.first == page.page; });
+                if (drained != plan.drained.end() && drained->second == cls) {
+                    chunk_freed = true; // handed over rather than unmapped
+                } else {
+                    freed += slab_->page_size();
+                }
+            } else {
+                chunk_freed = chunk_freed || page.cls == cls;
+            }
+        }
+        size_t grow = 0;
+        if (cls == fifos_.size() - 1) {
+            grow = slab_->grow_cost(size);
+        } else if (!chunk_freed && !slab_->has_chunk(cls, gone)) {
+            grow = slab_->page_size();
+        }
+        grows = grow != 0;
+        return slab_->committed() - freed + meta_ - plan.meta + meta + grow <= capacity_;
+    }
+
 public:
-    HotObjectCache(size_t capacity): capacity_(capacity), size_(0) {}
-    int store(std::string key, std::vector<char> bytes) {
-        if (size_ + bytes.size() > capacity_) {
+    S3FifoShard(size_t capacity):
+        capacity_(capacity),
+        meta_(0),
+        slab_(std::make_shared<SlabAllocator>(page_size_for(capacity))),
+        evictions_(0)
+    {
+        fifos_.resize(slab_->class_count());
+        tables_.emplace_back(new ReadTable(kMinReadTable));
+        table_.store(tables_.back().get(), std::memory_order_relaxed);
+    }
+
+    void set_admission_policy(std::function<bool(const std::string &, const std::string &)> admit) {
+        admit_ = admit;
+    }
+
+    void set_evict_listener(std::function<void(const std::string &, BufferHandle)> on_evict) {
+        on_evict_ = on_evict;
+    }
+
+    // the value is copied into a slab chunk, the caller's buffer is not retained
+    // returns -1, with the shard unchanged but for S3-FIFO aging, if the admission policy vetoes a victim
+    // or no amount of eviction makes room
+    int store_buffer(std::string key, BufferHandle buffer) {
+        size_t size = buffer->size();
+        size_t meta = entry_meta(key);
+        if (meta + std::max(slab_->grow_cost(size), slab_->page_size()) > capacity_) {
+            return -1;
+        }
+
+        Plan plan;
+        Queue queue = SMALL;
+        auto existing = index_.find(key);
+        if (existing != index_.end()) {
+            plan.replaced = &*existing->second;
+            account(plan, *existing->second);
+        } else if (ghost_index_.count(key)) {
+            queue = MAIN;
+        }
+
+        // a donor class gives up one page at a time; within a class victims go in S3-FIFO order
+        size_t cls = slab_->class_for(size);
+        size_t victim = fifos_.size();
+        bool grows;
+        while (!fits(plan, size, cls, meta, grows)) {
+            if (victim == fifos_.size() || fifos_[victim].count == 0) {
+                victim = victim_class(cls);
+            }
+            int paged = 0;
+            if (victim != fifos_.size() && victim != cls && victim != fifos_.size() - 1) {
+                // a page is taken only if it costs fewer objects than evicting for the bookkeeping
+                // that keeps a new page from being mapped
+                size_t need = slab_->committed() + meta_ - plan.meta + meta + slab_->page_size();
+                size_t per_entry = std::max<size_t>(1, meta_ / std::max<size_t>(1, index_.size()));
+                size_t most = need > capacity_ ? (need - capacity_) / per_entry : 0;
+                paged = plan_page(plan, victim, cls, key, most);
+                if (paged > 0) {
+                    victim = fifos_.size(); // automove is decided again for the next page
+                    continue;
+                }
+            }
+            if (paged < 0 || victim == fifos_.size() || !plan_step(plan, victim, key)) {
+                restore(plan); // chunks still referenced by readers, or a victim not admitted
+                return -1;
+            }
+        }
+
+        // memory to be mapped is mapped before anything is dropped; a chunk the plan frees is taken after
+        char *chunk = nullptr;
+        if (grows && !(chunk = slab_->allocate(size))) {
+            restore(plan);
+            return -1;
+        }
+        if (plan.replaced) {
+            // overwrite: the object keeps its place in main, if it earned one
+            queue = plan.replaced->queue;
+            if (!plan.replaced_doomed) {
+                remove(existing->second);
+            }
+        }
+        commit(plan);
+        if (!chunk) {
+            chunk = slab_->allocate(size); // a free chunk is waiting, nothing gets mapped
+        }
+        auto ghost = ghost_index_.find(key);
+        if (ghost != ghost_index_.end()) {
+            ghost_.erase(ghost->second);
+            ghost_index_.erase(ghost);
+        }
+        std::memcpy(chunk, buffer->data(), size);
+        BufferHandle stored = slab_buffer(chunk, size, buffer->freshness());
+
+        ClassFifo &fifo = fifos_[cls];
+        std::list<Entry> &list = (queue == SMALL) ? fifo.small : fifo.main;
+        list.emplace_front(std::move(key), std::move(stored), queue, cls);
+        publish(&list.front());
+        index_[list.front().key] = list.begin();
+        fifo.count++;
+        if (queue == SMALL) {
+            fifo.small_count++;
+        }
+        meta_ += meta;
+        return 0; // success
+    }
+
+    // lock free, safe against concurrent stores and evictions: the entry found in the read table stays
+    // valid while the epoch is pinned, and pinning writes a counter of this thread's own; freq is bumped
+    // with a plain atomic load/store (a racing bump may get lost, freq is a hint) and a saturated entry is
+    // not written at all, so readers of a hot object share no written cache line but the buffer's count
+    // a fetch racing a store of its key may find the old value, the new one, or neither
+    int fetch_buffer(std::string_view key, BufferHandle & buffer) const {
+        EpochDomain::Guard guard(epochs_);
+        Entry *entry = find_published(key);
+        if (!entry) {
+            return -1;
+        }
+        uint8_t freq = entry->freq.load(std::memory_order_relaxed);
+        if (freq < kMaxFreq) {
+            entry->freq.store(freq + 1, std::memory_order_relaxed);
+        }
+        buffer = entry->buffer;
+        return 0; // success
+    }
+
+    bool contains(std::string_view key) const {
+        EpochDomain::Guard guard(epochs_);
+        return find_published(key) != nullptr;
+    }
+
+    int erase(std::string_view key) {
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            return -1;
+        }
+        remove(it->second);
+        reclaim();
+        return 0;
+    }
+
+    size_t get_size() const {
+        return slab_->committed() + meta_;
+    }
+};
+
+// in-memory tier: the key hash picks one of shards_ S3-FIFO shards, each owning an equal slice of
+// the capacity
+// - fetches take no lock at all, they run against the shard's lock free read table; stores, erases (and
+//   the evictions they trigger) take the shard's mutex, for that shard only
+// - a fetch looks the key up as given, without copying it into a string first
+// - every shard gets at least kMinShardCapacity, so a small tier stays one shard and objects up to its
+//   whole capacity still fit
+// - eviction is per shard: the victim is the S3-FIFO choice within the candidate's shard
+// - hooks run with the shard's mutex held, they must not call back into the tier
+class HotObjectCache: public ICache {
+private:
+    struct Shard {
+        std::mutex mutex;
+        S3FifoShard fifo;
+
+        Shard(size_t capacity): fifo(capacity) {}
+    };
+
+    static const size_t kMinShardCapacity = 1 << 20;
+
+    size_t capacity_;
+    std::vector<std::unique_ptr<Shard>> shards_; // power of two
+
+    Shard& shard_for(std::string_view key) {
+        // fibonacci hashing on the top bits: the shard's own unordered_map consumes the low bits
+        uint64_t h = std::hash<std::string_view>()(key) * 0x9e3779b97f4a7c15ULL;
+        return *shards_[(h >> 32) & (shards_.size() - 1)];
+    }
+
+public:
+    // shards = 0 picks 4 per hardware thread (bounded by kMinShardCapacity)
+    HotObjectCache(size_t capacity, size_t shards = 0): capacity_(capacity) {
+        size_t wanted = shards ? shards : 4 * std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        size_t count = 1;
+        while (count * 2 <= wanted && (count * 2) * kMinShardCapacity <= capacity) {
+            count *= 2;
+        }
+        for (size_t i = 0; i < count; i++) {
+            shards_.emplace_back(new Shard(capacity / count));
+        }
+    }
+
+    void set_admission_policy(std::function<bool(const std::string &, const std::string &)> admit) {
+        for (auto &shard: shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->fifo.set_admission_policy(admit);
+        }
+    }
+
+    void set_evict_listener(std::function<void(const std::string &, BufferHandle)> on_evict) {
+        for (auto &shard: shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->fifo.set_evict_listener(on_evict);
+        }
+    }
+
+    int store(std::string key, std::vector<char> bytes) {
+        return store_buffer(key, make_buffer(std::move(bytes)));
+    }
+
+    // the bytes are copied once into a slab chunk of the key's shard and the caller's buffer is not retained
+    // (stores used to keep a reference to it, before values moved into slabs); hits are still zero copy,
+    // every fetch hands out another reference to the chunk
+    int store_buffer(std::string_view key, BufferHandle buffer) {
+        Shard &shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.fifo.store_buffer(std::string(key), std::move(buffer));
+    }
+
+
+    int fetch(std::string key, std::vector<char> & bytes) {
+        BufferHandle buffer;
+        if (fetch_buffer(key, buffer) != 0) {
+            return -1;
+        }
+        bytes.assign(buffer->data(), buffer->data() + buffer->size());
+        return 0; // success
+    }
+
+    // a hit hands out a reference to the cached bytes
+    int fetch_buffer(std::string_view key, BufferHandle & buffer) {
+        return shard_for(key).fifo.fetch_buffer(key, buffer);
+    }
+
+    bool contains(const std::string &key) {
+        return shard_for(key).fifo.contains(key);
+    }
+
+    int erase(std::string key) {
+        Shard &shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.fifo.erase(key);
+    }
+
+    size_t get_capacity()
+    {
+        return capacity_;
+    }
+
+    size_t get_size()
+    {
+        size_t size = 0;
+        for (auto &shard: shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            size += shard->fifo.get_size();
+        }
+        return size;
+    }
+
+    size_t shard_count() const {
+        return shards_.size();
+    }
+};
+
+// bloom filter over keys: may_contain() == false means the key is definitely absent
+// - k probes derived from one 64-bit hash by double hashing, bits packed into atomic words so lookups
+//   and inserts run without a lock
+// - bloom filters cannot delete: the owner rebuilds a fresh filter once enough keys went away
+class BloomFilter {
+private:
+    static const int kProbes = 7;    // optimal for ~10 bits per key, ~1% false positives
+    static const int kBitsPerKey = 10;
+
+    size_t bits_; // power of two
+    size_t expected_keys_;
+    std::unique_ptr<std::atomic<uint64_t>[]> words_;
+
+    static uint64_t hash(std::string_view key) {
+        uint64_t h = std::hash<std::string_view>()(key);
+        // splitmix64 finalizer, std::hash may be weak in the low bits
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+        return h;
+    }
+
+public:
+    BloomFilter(size_t expected_keys): bits_(1024), expected_keys_(expected_keys) {
+        while (bits_ < expected_keys * kBitsPerKey) {
+            bits_ <<= 1;
+        }
+        words_.reset(new std::atomic<uint64_t>[bits_ / 64]);
+        for (size_t i = 0; i < bits_ / 64; i++) {
+            words_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void insert(std::string_view key) {
+        uint64_t h = hash(key);
+        uint64_t delta = (h >> 32) | 1;
+        for (int i = 0; i < kProbes; i++, h += delta) {
+            size_t bit = h & (bits_ - 1);
+            words_[bit / 64].fetch_or(1ULL << (bit % 64), std::memory_order_relaxed);
+        }
+    }
+
+    bool may_contain(std::string_view key) const {
+        uint64_t h = hash(key);
+        uint64_t delta = (h >> 32) | 1;
+        for (int i = 0; i < kProbes; i++, h += delta) {
+            size_t bit = h & (bits_ - 1);
+            if (!(words_[bit / 64].load(std::memory_order_relaxed) & (1ULL << (bit % 64)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t expected_keys() const {
+        return expected_keys_;
+    }
+};
+
+// value codecs of the disk tier, the compressor abstraction of adapter2.cpp working on buffers
+// the codec id is written into every record, so a tier can hold a mix of raw and compressed records
+enum CompressionType {
+    NO_COMPRESSION = 0,
+    LZ = 1
+};
+
+class ICompressor {
+public:
+    virtual ~ICompressor() {}
+    // compress
+    virtual int deflate(const char *in, size_t len, std::vector<char> &out) = 0;
+    // decompress, raw_len is the size deflate was given
+    virtual int inflate(const char *in, size_t len, size_t raw_len, std::vector<char> &out) = 0;
+};
+
+// byte oriented LZ77 in the LZ4 block format family: fast enough to sit on the fetch path
+// - a sequence is [token][literal length ext][literals][offset: u16 le][match length ext]
+//   token = literal length (high nibble) | match length - 4 (low nibble), a nibble of 15 continues in
+//   extension bytes of 255 + ... + remainder
+// - the last sequence carries literals only; matches never start in the last kLastLiterals bytes
+// - inflate bounds checks every length and offset, a corrupt record fails instead of overrunning
+class LzCompressor: public ICompressor {
+private:
+    static const int kHashBits = 12;
+    static const size_t kMinMatch = 4;
+    static const size_t kMaxOffset = 65535;
+    static const size_t kLastLiterals = 12;
+
+    static void put_length(std::vector<char> &out, size_t n) {
+        for (; n >= 255; n -= 255) {
+            out.push_back(static_cast<char>(255));
+        }
+        out.push_back(static_cast<char>(n));
+    }
+
+    static int get_length(const char *in, size_t len, size_t &ip, size_t &n) {
+        uint8_t b;
+        do {
+            if (ip >= len) {
+                return -1;
+            }
+            b = static_cast<uint8_t>(in[ip++]);
+            n += b;
+        } while (b == 255);
+        return 0;
+    }
+
+    static void put_sequence(std::vector<char> &out, const char *literals, size_t lit_len, size_t offset, size_t match_len) {
+        size_t match_code = match_len ? match_len - kMinMatch : 0;
+        out.push_back(static_cast<char>((std::min<size_t>(lit_len, 15) << 4) | std::min<size_t>(match_code, 15)));
+        if (lit_len >= 15) {
+            put_length(out, lit_len - 15);
+        }
+        out.insert(out.end(), literals, literals + lit_len);
+        if (match_len) {
+            out.push_back(static_cast<char>(offset & 0xff));
+            out.push_back(static_cast<char>(offset >> 8));
+            if (match_code >= 15) {
+                put_length(out, match_code - 15);
+            }
+        }
+    }
+
+public:
+    int deflate(const char *in, size_t len, std::vector<char> &out) {
+        uint32_t table[1 << kHashBits] = {0}; // hash of 4 bytes -> last position seen
+        out.clear();
+        out.reserve(len + len / 255 + 16);
+        size_t anchor = 0;
+        size_t i = 0;
+        size_t match_limit = len > kLastLiterals ? len - kLastLiterals : 0;
+        while (i < match_limit) {
+            uint32_t seq, candidate_seq;
+            std::memcpy(&seq, in + i, sizeof(seq));
+            uint32_t h = (seq * 2654435761u) >> (32 - kHashBits);
+            size_t candidate = table[h];
+            table[h] = static_cast<uint32_t>(i);
+            std::memcpy(&candidate_seq, in + candidate, sizeof(candidate_seq));
+            if (candidate >= i || i - candidate > kMaxOffset || candidate_seq != seq) {
+                i++;
+                continue;
+            }
+            size_t match_len = kMinMatch;
+            while (i + match_len < len && in[candidate + match_len] == in[i + match_len]) {
+                match_len++;
+            }
+            put_sequence(out, in + anchor, i - anchor, i - candidate, match_len);
+            i += match_len;
+            anchor = i;
+        }
+        put_sequence(out, in + anchor, len - anchor, 0, 0);
+        return 0;
+    }
+
+    int inflate(const char *in, size_t len, size_t raw_len, std::vector<char> &out) {
+        out.resize(raw_len);
+        size_t ip = 0;
+        size_t op = 0;
+        while (ip < len) {
+            uint8_t token = static_cast<uint8_t>(in[ip++]);
+            size_t lit_len = token >> 4;
+            if (lit_len == 15 && get_length(in, len, ip, lit_len) != 0) {
+                return -1;
+            }
+            if (lit_len > len - ip || lit_len > raw_len - op) {
+                return -1;
+            }
+            std::copy(in + ip, in + ip + lit_len, out.begin() + op);
+            ip += lit_len;
+            op += lit_len;
+            if (ip == len) {
+                break; // literals only: the last sequence
+            }
+            if (len - ip < 2) {
+                return -1;
+            }
+            size_t offset = static_cast<uint8_t>(in[ip]) | (static_cast<size_t>(static_cast<uint8_t>(in[ip + 1])) << 8);
+            ip += 2;
+            size_t match_len = token & 15;
+            if (match_len == 15 && get_length(in, len, ip, match_len) != 0) {
+                return -1;
+            }
+            match_len += kMinMatch;
+            if (offset == 0 || offset > op || match_len > raw_len - op) {
+                return -1;
+            }
+            // byte by byte: the match may overlap the bytes it produces (runs)
+            for (size_t k = 0; k < match_len; k++, op++) {
+                out[op] = out[op - offset];
+            }
+        }
+        return op == raw_len ? 0 : -1;
+    }
+};
+
+// codecs are stateless, one shared instance per type; nullptr for NO_COMPRESSION
+ICompressor* compressor_for(CompressionType type) {
+    static LzCompressor lz;
+    return type == LZ ? &lz : nullptr;
+}
+
+// on-disk tier: log structured
+// - objects are appended to the active segment file; a full segment is sealed and never written again
+// - index_ maps key -> (segment, offset, len) of the latest copy of the object
+// - reads are served from an mmap of the segment, no per-key files and no random writes
+// - overwrites only leave a dead record behind; a background compactor copies the live records out of
+//   mostly dead segments and deletes the segment file
+// - when the tier is full, the oldest segment is dropped as a whole (fifo at segment granularity)
+// - a bloom filter of the indexed keys lets callers skip the tier for keys it never held; the compactor
+//   rebuilds it once enough keys have been removed (or the tier outgrew it)
+// - warm restart: the compactor periodically persists index_ as a snapshot (see build_snapshot), and
+//   segments are the redo log for everything after it; a restarted tier loads the snapshot, replays
+//   only the records appended after the snapshot's watermark, and serves hits right away
+// record layout: [key_len: u32][val_len: u32][raw_len: u32][codec: u8][pad: 3][expires_at_ms: i64]
+//                [stale_until_ms: i64][key bytes][value bytes]
+// - val_len is the stored (possibly compressed) length, raw_len the length fetch hands back
+// - with set_compression(LZ), values are compressed on the way in and decompressed on fetch; values that
+//   do not shrink by at least 1/8 are stored raw, compaction copies records without recompressing them
+// records that are dead (past stale_until_ms) or obsolete per the owner's filter are not carried along
+// by compaction; request_sweep() also unlinks every obsolete key, so their segments become compactable
+// an erase appends a tombstone record (val_len = kTombstone, no value bytes) so it survives a restart
+// size_ counts key + stored value bytes of live records only, so compressed records take less capacity
+class DiskCache: public ICache {
+private:
+    struct Location {
+        uint32_t segment;
+        uint64_t offset; // offset of the record header within the segment
+        uint32_t key_len;
+        uint32_t val_len;
+        uint32_t raw_len;
+    };
+
+    struct Segment {
+        uint32_t id;
+        int fd;
+        size_t size;       // bytes appended so far
+        size_t live;       // key + value bytes still referenced by index_
+        std::shared_ptr<const char> map; // readers keep it, and read records after releasing mutex_
+        size_t map_len;
+        bool sealed;
+    };
+
+    // index snapshot file: header, then entry_count fixed size entries, then the key bytes
+    // fixed size entries keep the file loadable straight from an mmap
+    struct SnapshotHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t watermark_segment; // records at or after (watermark_segment, watermark_offset)
+        uint64_t watermark_offset;  // are not in the snapshot and get replayed from the segments
+        uint64_t entry_count;
+        uint64_t keys_offset;
+        uint32_t next_segment_id; // ids below it may name deleted segments, they are never reused
+        uint32_t reserved;
+    };
+
+    struct SnapshotEntry {
+        uint32_t segment;
+        uint32_t key_len;
+        uint32_t val_len;
+        uint32_t raw_len;
+        uint64_t offset;
+        uint64_t key_offset; // into the key bytes
+    };
+
+    struct RecordHeader {
+        uint32_t key_len;
+        uint32_t val_len;
+        uint32_t raw_len;
+        uint8_t codec;  // CompressionType
+        uint8_t pad[3];
+        Freshness freshness;
+    };
+
+    static_assert(sizeof(SnapshotHeader) == 48 && sizeof(SnapshotEntry) == 32, "snapshot layout");
+    static_assert(sizeof(RecordHeader) == 32, "record layout");
+
+    static const size_t kRecordHeader = sizeof(RecordHeader);
+    static const uint32_t kTombstone = 0xffffffff;
+    static const uint32_t kSnapshotVersion = 4;
+    // values shorter than this are not worth a compression attempt
+    static const size_t kMinCompressLen = 64;
+    // a sealed segment with less than this fraction of live bytes gets compacted
+    static constexpr double kCompactThreshold = 0.5;
+    static constexpr std::chrono::seconds kSnapshotInterval = std::chrono::seconds(30);
+
+    size_t capacity_;
+    size_t size_;
+    size_t raw_size_;   // like size_, with values counted at their uncompressed length
+    size_t segment_size_;
+    std::string dir_;
+    uint32_t next_segment_id_;
+    std::map<uint32_t, Segment*> segments_; // ordered oldest first
+    Segment *active_;
+    std::unordered_map<std::string, Location> index_;
+    uint32_t snapshot_segment_; // watermark segment of the last persisted snapshot
+    bool dirty_;                // index_ changed since the last snapshot
+    std::shared_ptr<BloomFilter> filter_; // swapped atomically, may_contain() reads it without mutex_
+    size_t filter_removals_;    // keys unlinked since filter_ was built, still set in it
+    std::atomic<int> compression_; // CompressionType for new records, read without mutex_
+    std::function<bool(const std::string &key)> is_obsolete_; // keys nobody can fetch anymore
+    bool sweep_requested_;
+
+    std::mutex mutex_;
+    std::condition_variable compactor_cv_;
+    bool stop_;
+    std::thread compactor_;
+
+    std::string segment_path(uint32_t id) {
+        return dir_ + "/" + std::to_string(id) + ".seg";
+    }
+
+    std::string snapshot_path() {
+        return dir_ + "/index.snap";
+    }
+
+    static size_t record_len(uint32_t key_len, uint32_t val_len) {
+        return kRecordHeader + key_len + (val_len == kTombstone ? 0 : val_len);
+    }
+
+    Segment* open_segment() {
+        uint32_t id = next_segment_id_++;
+        int fd = ::open(segment_path(id).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return nullptr;
+        }
+        Segment *seg = new Segment{id, fd, 0, 0, nullptr, 0, false};
+        segments_[id] = seg;
+        return seg;
+    }
+
+    void close_segment(Segment *seg) {
+        ::close(seg->fd);
+        segments_.erase(seg->id);
+        if (seg == active_) {
+            active_ = nullptr;
+        }
+        delete seg;
+    }
+
+    void drop_segment(Segment *seg) {
+        ::unlink(segment_path(seg->id).c_str());
+        close_segment(seg);
+    }
+
+    // make sure [0, len) of the segment is visible through its mapping
+    // the mapping covers a whole segment up front, so the active segment is not remapped on every append
+    // records never change once written: whoever holds the mapping may read them without mutex_, even
+    // after the segment is remapped or deleted (it is unmapped with its last holder)
+    std::shared_ptr<const char> map_segment(Segment *seg, size_t len) {
+        if (seg->map_len < len) {
+            seg->map.reset();
+            seg->map_len = 0;
+            size_t map_len = std::max(seg->size, segment_size_);
+            void *addr = ::mmap(nullptr, map_len, PROT_READ, MAP_SHARED, seg->fd, 0);
+            if (addr == MAP_FAILED) {
+                return nullptr;
+            }
+            seg->map = std::shared_ptr<const char>(static_cast<const char*>(addr), [map_len](const char *base) {
+                ::munmap(const_cast<char*>(base), map_len);
+            });
+            seg->map_len = map_len;
+        }
+        return seg->map;
+    }
+
+    // looks key up and hands out the mapping its record is read through
+    int find_record(const std::string &key, Location &loc, std::shared_ptr<const char> &map) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            return -1;
+        }
+        loc = it->second;
+        map = map_segment(segments_[loc.segment], loc.offset + record_len(loc.key_len, loc.val_len));
+        return map ? 0 : -1;
+    }
+
+    static void read_header(const char *record, RecordHeader &header) {
+        std::memcpy(&header, record, sizeof(RecordHeader));
+    }
+
+    static RecordHeader make_header(const std::string &key, uint32_t val_len, uint32_t raw_len, uint8_t codec,
+                                    const Freshness &freshness) {
+        RecordHeader header = {static_cast<uint32_t>(key.size()), val_len, raw_len, codec, {0, 0, 0}, freshness};
+        return header;
+    }
+
+    // the uncompressed value of a record into bytes; runs without mutex_, so hits inflate in parallel
+    static int read_record(const char *map, const Location &loc, std::vector<char> &bytes, RecordHeader &header) {
+        const char *val = map + loc.offset + kRecordHeader + loc.key_len;
+        read_header(map + loc.offset, header);
+        ICompressor *compressor = compressor_for(static_cast<CompressionType>(header.codec));
+        if (!compressor) {
+            bytes.assign(val, val + loc.val_len);
+            return 0;
+        }
+        return compressor->inflate(val, loc.val_len, header.raw_len, bytes);
+    }
+
+    static BufferHandle read_buffer(const char *map, const Location &loc) {
+        std::vector<char> bytes;
+        RecordHeader header;
+        if (read_record(map, loc, bytes, header) != 0) {
+            return nullptr;
+        }
+        return make_buffer(std::move(bytes), header.freshness);
+    }
+
+    // header of the record a value gets stored as; compresses the value into packed when the tier
+    // compresses and it pays off, otherwise the record holds the value as is
+    // runs without mutex_, so concurrent stores compress in parallel
+    RecordHeader encode(const std::string &key, const char *val, size_t val_len, const Freshness &freshness,
+                        std::vector<char> &packed) {
+        CompressionType type = static_cast<CompressionType>(compression_.load(std::memory_order_relaxed));
+        ICompressor *compressor = compressor_for(type);
+        uint32_t raw_len = static_cast<uint32_t>(val_len);
+        if (compressor && val_len >= kMinCompressLen && compressor->deflate(val, val_len, packed) == 0
+            && packed.size() <= val_len - val_len / 8) {
+            return make_header(key, static_cast<uint32_t>(packed.size()), raw_len, type, freshness);
+        }
+        packed.clear();
+        return make_header(key, raw_len, raw_len, NO_COMPRESSION, freshness);
+    }
+
+    // walks the records in [offset, size) of a segment mapping; stops early at a torn record (crash mid
+    // append) and returns the offset just past the last complete record
+    template <typename Visitor>
+    static size_t scan_records(const char *base, size_t size, size_t offset, Visitor visit) {
+        while (offset + kRecordHeader <= size) {
+            RecordHeader header;
+            read_header(base + offset, header);
+            size_t len = record_len(header.key_len, header.val_len);
+            if (offset + len > size || offset + len < offset) {
+                break;
+            }
+            visit(std::string(base + offset + kRecordHeader, header.key_len), offset, header);
+            offset += len;
+        }
+        return offset;
+    }
+
+    template <typename Visitor>
+    size_t scan_segment(Segment *seg, size_t offset, Visitor visit) {
+        std::shared_ptr<const char> map = map_segment(seg, seg->size);
+        return map ? scan_records(map.get(), seg->size, offset, visit) : offset;
+    }
+
+    bool is_current(const std::string &key, uint32_t segment, size_t offset) {
+        auto it = index_.find(key);
+        return it != index_.end() && it->second.segment == segment && it->second.offset == offset;
+    }
+
+    int write_record(const std::string &key, const char *val, const RecordHeader &header) {
+        size_t len = record_len(header.key_len, header.val_len);
+        if (active_ && active_->size > 0 && active_->size + len > segment_size_) {
+            active_->sealed = true;
+            active_ = nullptr;
+            compactor_cv_.notify_one();
+        }
+        if (!active_ && !(active_ = open_segment())) {
+            return -1;
+        }
+
+        struct iovec iov[3] = {
+            {const_cast<RecordHeader*>(&header), kRecordHeader},
+            {const_cast<char*>(key.data()), key.size()},
+            {const_cast<char*>(val), len - kRecordHeader - key.size()}
+        };
+        if (::pwritev(active_->fd, iov, 3, active_->size) != static_cast<ssize_t>(len)) {
+            return -1;
+        }
+        active_->size += len;
+        dirty_ = true;
+        return 0;
+    }
+
+    int append(const std::string &key, const char *val, const RecordHeader &header) {
+        if (write_record(key, val, header) != 0) {
+            return -1;
+        }
+        // write_record may have rolled over to a fresh segment, the record is the last one in active_
+        size_t offset = active_->size - record_len(header.key_len, header.val_len);
+        link_record(key, Location{active_->id, offset, header.key_len, header.val_len, header.raw_len});
+        return 0;
+    }
+
+    void link_record(const std::string &key, const Location &loc) {
+        unlink_record(key);
+        if (filter_) {
+            filter_->insert(key);
+        }
+        index_[key] = loc;
+        segments_[loc.segment]->live += loc.key_len + loc.val_len;
+        size_ += loc.key_len + loc.val_len;
+        raw_size_ += loc.key_len + loc.raw_len;
+    }
+
+    // forget the current copy of key, its record becomes dead space in its segment
+    void unlink_record(const std::string &key) {
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            return;
+        }
+        size_t charge = it->second.key_len + it->second.val_len;
+        segments_[it->second.segment]->live -= charge;
+        size_ -= charge;
+        raw_size_ -= it->second.key_len + it->second.raw_len;
+        index_.erase(it);
+        filter_removals_++;
+        dirty_ = true;
+    }
+
+    // fresh filter over the current keys, sized with headroom for growth
+    void rebuild_filter() {
+        auto filter = std::make_shared<BloomFilter>(std::max<size_t>(2 * index_.size(), 1024));
+        for (auto &entry: index_) {
+            filter->insert(entry.first);
+        }
+        std::atomic_store(&filter_, filter);
+        filter_removals_ = 0;
+    }
+
+    bool filter_is_stale() {
+        return filter_removals_ > index_.size() / 2 || index_.size() > filter_->expected_keys();
+    }
+
+    void evict_oldest_segment() {
+        Segment *oldest = segments_.begin()->second;
+        scan_segment(oldest, 0, [&](const std::string &key, size_t off, const RecordHeader &) {
+            if (is_current(key, oldest->id, off)) {
+                unlink_record(key);
+            }
+        });
+        drop_segment(oldest);
+    }
+
+    // copies the live records of sealed segments into a new segment, then deletes them; mutex_ is only
+    // held to pick the records still current and to relink the ones not stored, erased or evicted since
+    // - stores go to segments after the new one from the start, so a replay still lets them win
+    // - the new segment joins segments_ once written, eviction cannot pull it away mid copy
+    // - tombstones newer than the last snapshot are carried along, older ones are already reflected in it
+    // - objects past their stale window are dropped here instead of being copied
+    void compact_segments(std::unique_lock<std::mutex> &lock, const std::vector<Segment*> &victims) {
+        struct Source {
+            uint32_t id;
+            size_t size;
+            std::shared_ptr<const char> map;
+            bool keep_tombstones;
+        };
+        struct Survivor {
+            std::string key;
+            uint32_t segment;
+            size_t offset;
+            RecordHeader header;
+            const char *record;
+            bool dead;
+            size_t new_offset;
+        };
+        std::vector<Source> sources;
+        for (auto seg: victims) {
+            std::shared_ptr<const char> map = map_segment(seg, seg->size);
+            if (map) {
+                sources.push_back(Source{seg->id, seg->size, map, seg->id >= snapshot_segment_});
+            }
+        }
+        if (sources.empty()) {
+            return;
+        }
+        if (active_ && active_->size == 0) {
+            drop_segment(active_);
+        } else if (active_) {
+            active_->sealed = true;
+            active_ = nullptr;
+        }
+        uint32_t id = next_segment_id_++;
+        std::function<bool(const std::string &key)> is_obsolete = is_obsolete_;
+        lock.unlock();
+
+        int64_t now = now_ms();
+        std::vector<Survivor> records;
+        for (auto &source: sources) {
+            scan_records(source.map.get(), source.size, 0, [&](const std::string &key, size_t off, const RecordHeader &header) {
+                bool tombstone = header.val_len == kTombstone;
+                if (tombstone && !source.keep_tombstones) {
+                    return;
+                }
+                bool dead = !tombstone && (header.freshness.state(now) == Freshness::DEAD || (is_obsolete && is_obsolete(key)));
+                records.push_back(Survivor{key, source.id, off, header, source.map.get() + off, dead, 0});
+            });
+        }
+
+        lock.lock();
+        records.erase(std::remove_if(records.begin(), records.end(), [this](const Survivor &r) {
+            if (r.header.val_len == kTombstone) {
+                return index_.count(r.key) > 0;
+            }
+            if (!is_current(r.key, r.segment, r.offset)) {
+                return true;
+            }
+            if (r.dead) {
+                unlink_record(r.key);
+                return true;
+            }
+            return false;
+        }), records.end());
+        lock.unlock();
+
+        int fd = -1;
+        size_t size = 0;
+        bool ok = true;
+        if (!records.empty()) {
+            fd = ::open(segment_path(id).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            ok = fd >= 0;
+        }
+        for (auto &r: records) {
+            size_t len = record_len(r.header.key_len, r.header.val_len); // stored bytes as is, no recompression
+            if (!ok || ::pwrite(fd, r.record, len, size) != static_cast<ssize_t>(len)) {
+                ok = false;
+                break;
+            }
+            r.new_offset = size;
+            size += len;
+        }
+
+        lock.lock();
+        if (!ok) {
+            if (fd >= 0) {
+                ::close(fd);
+                ::unlink(segment_path(id).c_str());
+            }
+            return; // keep the sources, retry on the next pass
+        }
+        if (fd >= 0) {
+            segments_[id] = new Segment{id, fd, size, 0, nullptr, 0, true};
+        }
+        for (auto &r: records) {
+            if (r.header.val_len != kTombstone && is_current(r.key, r.segment, r.offset)) {
+                link_record(r.key, Location{id, r.new_offset, r.header.key_len, r.header.val_len, r.header.raw_len});
+            }
+        }
+        for (auto &source: sources) {
+            auto seg = segments_.find(source.id);
+            if (seg != segments_.end()) {
+                drop_segment(seg->second);
+            }
+        }
+        dirty_ = true;
+    }
+
+    // serializes index_ into a snapshot image; called with mutex_ held, the slow file io happens later
+    std::vector<char> build_snapshot(uint32_t &watermark_segment) {
+        SnapshotHeader header;
+        std::memcpy(header.magic, "SCDISKIX", sizeof(header.magic));
+        header.version = kSnapshotVersion;
+        header.watermark_segment = active_ ? active_->id : next_segment_id_;
+        header.watermark_offset = active_ ? active_->size : 0;
+        header.entry_count = index_.size();
+        header.keys_offset = sizeof(SnapshotHeader) + index_.size() * sizeof(SnapshotEntry);
+        header.next_segment_id = next_segment_id_;
+        header.reserved = 0;
+
+        size_t key_bytes = 0;
+        for (auto &entry: index_) {
+            key_bytes += entry.first.size();
+        }
+        std::vector<char> image(header.keys_offset + key_bytes);
+        std::memcpy(image.data(), &header, sizeof(header));
+        char *entries = image.data() + sizeof(SnapshotHeader);
+        uint64_t key_offset = 0;
+        for (auto &entry: index_) {
+            const Location &loc = entry.second;
+            SnapshotEntry snap_entry = {loc.segment, loc.key_len, loc.val_len, loc.raw_len, loc.offset, key_offset};
+            std::memcpy(entries, &snap_entry, sizeof(snap_entry));
+            entries += sizeof(snap_entry);
+            std::memcpy(image.data() + header.keys_offset + key_offset, entry.first.data(), entry.first.size());
+            key_offset += entry.first.size();
+        }
+        watermark_segment = header.watermark_segment;
+        dirty_ = false;
+        return image;
+    }
+
+    // write to a temp file and rename it over the old snapshot, so a crash leaves one or the other
+    bool persist_snapshot(const std::vector<char> &image) {
+        std::string tmp_path = snapshot_path() + ".tmp";
+        int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = ::write(fd, image.data(), image.size()) == static_cast<ssize_t>(image.size());
+        ok = ok && ::fsync(fd) == 0;
+        ::close(fd);
+        return ok && ::rename(tmp_path.c_str(), snapshot_path().c_str()) == 0;
+    }
+
+    // loads the snapshot (if any) and returns its watermark; (0, 0) means replay every segment
+    void load_snapshot(uint32_t &watermark_segment, uint64_t &watermark_offset) {
+        watermark_segment = 0;
+        watermark_offset = 0;
+        int fd = ::open(snapshot_path().c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        void *addr = MAP_FAILED;
+        if (::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(SnapshotHeader)) {
+            addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            return;
+        }
+
+        const char *base = static_cast<const char*>(addr);
+        const SnapshotHeader *header = reinterpret_cast<const SnapshotHeader*>(base);
+        size_t file_size = st.st_size;
+        bool valid = std::memcmp(header->magic, "SCDISKIX", sizeof(header->magic)) == 0
+            && header->version == kSnapshotVersion
+            && header->keys_offset == sizeof(SnapshotHeader) + header->entry_count * sizeof(SnapshotEntry)
+            && header->keys_offset <= file_size;
+        if (valid) {
+            const SnapshotEntry *entries = reinterpret_cast<const SnapshotEntry*>(base + sizeof(SnapshotHeader));
+            index_.reserve(header->entry_count);
+            // a later run may have replaced a segment the snapshot names with one of the same id
+            next_segment_id_ = std::max(next_segment_id_, header->next_segment_id);
+            for (uint64_t i = 0; i < header->entry_count; i++) {
+                const SnapshotEntry &e = entries[i];
+                auto seg = segments_.find(e.segment);
+                // the segment may have been evicted or compacted away after the snapshot was taken
+                if (seg == segments_.end() || e.val_len == kTombstone
+                    || e.offset + record_len(e.key_len, e.val_len) > seg->second->size
+                    || header->keys_offset + e.key_offset + e.key_len > file_size) {
+                    continue;
+                }
+                std::string key(base + header->keys_offset + e.key_offset, e.key_len);
+                if (!holds_record(seg->second, e.offset, key, e.val_len)) {
+                    continue; // the snapshot is out of date, the replay finds the key if it is still there
+                }
+                link_record(key, Location{e.segment, e.offset, e.key_len, e.val_len, e.raw_len});
+            }
+            watermark_segment = header->watermark_segment;
+            watermark_offset = header->watermark_offset;
+            snapshot_segment_ = watermark_segment;
+        }
+        ::munmap(addr, file_size);
+    }
+
+    // true if the record at offset in seg is a value of key, val_len bytes long
+    bool holds_record(Segment *seg, uint64_t offset, const std::string &key, uint32_t val_len) {
+        std::shared_ptr<const char> map = map_segment(seg, seg->size);
+        if (!map) {
+            return false;
+        }
+        RecordHeader header;
+        read_header(map.get() + offset, header);
+        return header.key_len == key.size() && header.val_len == val_len
+            && std::memcmp(map.get() + offset + kRecordHeader, key.data(), key.size()) == 0;
+    }
+
+    // rebuilds index_ from the snapshot plus the segment records appended after it
+    void recover() {
+        std::error_code ec;
+        for (auto &file: std::filesystem::directory_iterator(dir_, ec)) {
+            if (file.path().extension() != ".seg") {
+                continue;
+            }
+            // segment files are named by their id; anything else in the directory is not ours
+            std::string stem = file.path().stem().string();
+            uint32_t id;
+            auto parsed = std::from_chars(stem.data(), stem.data() + stem.size(), id);
+            if (stem.empty() || parsed.ec != std::errc() || parsed.ptr != stem.data() + stem.size()) {
+                continue;
+            }
+            int fd = ::open(file.path().c_str(), O_RDWR);
+            if (fd < 0) {
+                continue;
+            }
+            struct stat st;
+            if (::fstat(fd, &st) != 0) {
+                ::close(fd);
+                continue;
+            }
+            segments_[id] = new Segment{id, fd, static_cast<size_t>(st.st_size), 0, nullptr, 0, true};
+            next_segment_id_ = std::max(next_segment_id_, id + 1);
+        }
+
+        uint32_t watermark_segment;
+        uint64_t watermark_offset;
+        load_snapshot(watermark_segment, watermark_offset);
+
+        for (auto it = segments_.lower_bound(watermark_segment); it != segments_.end(); ++it) {
+            Segment *seg = it->second;
+            size_t from = (seg->id == watermark_segment) ? watermark_offset : 0;
+            size_t end = scan_segment(seg, from, [&](const std::string &key, size_t off, const RecordHeader &header) {
+                if (header.val_len == kTombstone) {
+                    unlink_record(key);
+                } else {
+                    link_record(key, Location{seg->id, off, header.key_len, header.val_len, header.raw_len});
+                }
+            });
+            if (end < seg->size) {
+                // drop a torn tail left by a crash mid append
+                if (::ftruncate(seg->fd, end) == 0) {
+                    seg->size = end;
+                }
+            }
+        }
+
+        while (size_ > capacity_ && !segments_.empty()) {
+            evict_oldest_segment();
+        }
+        dirty_ = true;
+        rebuild_filter();
+    }
+
+    // no tombstones needed: an obsolete key stays obsolete, a restart that resurrects it drops it again
+    void sweep_obsolete() {
+        std::vector<std::string> obsolete;
+        for (auto &entry: index_) {
+            if (is_obsolete_(entry.first)) {
+                obsolete.push_back(entry.first);
+            }
+        }
+        for (auto &key: obsolete) {
+            unlink_record(key);
+        }
+    }
+
+    void compactor_loop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto last_snapshot = std::chrono::steady_clock::now();
+        while (!stop_) {
+            compactor_cv_.wait_for(lock, std::chrono::seconds(1));
+            if (sweep_requested_ && is_obsolete_) {
+                sweep_obsolete();
+            }
+            sweep_requested_ = false;
+            std::vector<Segment*> victims;
+            for (auto &entry: segments_) {
+                Segment *seg = entry.second;
+                if (seg->sealed && seg->live < seg->size * kCompactThreshold) {
+                    victims.push_back(seg);
+                }
+            }
+            if (!victims.empty()) {
+                compact_segments(lock, victims);
+            }
+            if (filter_is_stale()) {
+                rebuild_filter();
+            }
+
+            if (dirty_ && std::chrono::steady_clock::now() - last_snapshot >= kSnapshotInterval) {
+                uint32_t watermark_segment;
+                std::vector<char> image = build_snapshot(watermark_segment);
+                lock.unlock();
+                bool persisted = persist_snapshot(image);
+                lock.lock();
+                if (persisted) {
+                    snapshot_segment_ = watermark_segment;
+                } else {
+                    dirty_ = true;
+                }
+                last_snapshot = std::chrono::steady_clock::now();
+            }
+        }
+    }
+
+public:
+    // reopens whatever an earlier DiskCache left in dir
+    DiskCache(size_t capacity, std::string dir = "smartcache_disk", size_t segment_size = 1 << 20):
+        capacity_(capacity),
+        size_(0),
+        raw_size_(0),
+        segment_size_(segment_size),
+        dir_(dir),
+        next_segment_id_(0),
+        active_(nullptr),
+        snapshot_segment_(0),
+        dirty_(false),
+        filter_removals_(0),
+        compression_(NO_COMPRESSION),
+        sweep_requested_(false),
+        stop_(false)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(dir_, ec);
+        recover();
+        compactor_ = std::thread(&DiskCache::compactor_loop, this);
+    }
+
+    // a clean shutdown leaves a snapshot with nothing to replay behind it
+    ~DiskCache() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        compactor_cv_.notify_one();
+        compactor_.join();
+        uint32_t watermark_segment;
+        persist_snapshot(build_snapshot(watermark_segment));
+        while (!segments_.empty()) {
+            close_segment(segments_.begin()->second);
+        }
+    }
+
+    int store(std::string key, std::vector<char> bytes) {
+        return store_bytes(key, bytes.data(), bytes.size());
+    }
+
+    // written straight from the shared buffer, no intermediate copy
+    int store_buffer(std::string_view key, BufferHandle buffer) {
+        return store_bytes(std::string(key), buffer->data(), buffer->size(), buffer->freshness());
+    }
+
+    int store_bytes(const std::string &key, const char *val, size_t val_len,
+                    const Freshness &freshness = Freshness::forever()) {
+        std::vector<char> packed;
+        RecordHeader header = encode(key, val, val_len, freshness, packed);
+        std::lock_guard<std::mutex> lock(mutex_);
+        return store_locked(key, packed.empty() ? val : packed.data(), header);
+    }
+
+    // one lock round trip for the whole batch, values are compressed before taking it
+    size_t store_many(const std::vector<std::string_view> &keys, const std::vector<BufferHandle> &buffers) {
+        std::vector<std::string> owned_keys(keys.begin(), keys.end());
+        std::vector<std::vector<char>> packed(keys.size());
+        std::vector<RecordHeader> headers;
+        headers.reserve(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            headers.push_back(encode(owned_keys[i], buffers[i]->data(), buffers[i]->size(), buffers[i]->freshness(), packed[i]));
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t stored = 0;
+        for (size_t i = 0; i < keys.size(); i++) {
+            const char *val = packed[i].empty() ? buffers[i]->data() : packed[i].data();
+            if (store_locked(owned_keys[i], val, headers[i]) == 0) {
+                stored++;
+            }
+        }
+        return stored;
+    }
+
+    int store_locked(const std::string &key, const char *val, const RecordHeader &header) {
+        size_t charge = key.size() + header.val_len;
+        if (charge > capacity_) {
+            return -1;
+        }
+        unlink_record(key);
+        while (size_ + charge > capacity_) {
+            evict_oldest_segment();
+        }
+        return append(key, val, header);
+    }
+
+
+    // the record is copied out (and inflated) after mutex_ is released
+    int fetch(std::string key, std::vector<char> & bytes) {
+        Location loc;
+        std::shared_ptr<const char> map;
+        if (find_record(key, loc, map) != 0) {
+            return -1;
+        }
+        RecordHeader header;
+        return read_record(map.get(), loc, bytes, header); // 0 on success
+    }
+
+    // the returned buffer carries the freshness stored with the record
+    int fetch_buffer(std::string_view key, BufferHandle & buffer) {
+        Location loc;
+        std::shared_ptr<const char> map;
+        if (find_record(std::string(key), loc, map) != 0) {
+            return -1;
+        }
+        buffer = read_buffer(map.get(), loc);
+        return buffer ? 0 : -1;
+    }
+
+    // one lock round trip for the whole batch, the records are read after it; they are read in
+    // (segment, offset) order so the batch walks each segment mapping front to back instead of jumping
+    // around
+    size_t fetch_many(const std::vector<std::string_view> &keys, std::vector<BufferHandle> &buffers) {
+        buffers.assign(keys.size(), nullptr);
+        std::vector<std::pair<Location, size_t>> found;
+        std::vector<std::shared_ptr<const char>> maps(keys.size());
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (size_t i = 0; i < keys.size(); i++) {
+                auto it = index_.find(std::string(keys[i]));
+                if (it == index_.end()) {
+                    continue;
+                }
+                const Location &loc = it->second;
+                maps[i] = map_segment(segments_[loc.segment], loc.offset + record_len(loc.key_len, loc.val_len));
+                if (maps[i]) {
+                    found.push_back(std::make_pair(loc, i));
+                }
+            }
+        }
+        std::sort(found.begin(), found.end(), [](const std::pair<Location, size_t> &a, const std::pair<Location, size_t> &b) {
+            return a.first.segment != b.first.segment ? a.first.segment < b.first.segment : a.first.offset < b.first.offset;
+        });
+        size_t hits = 0;
+        for (auto &entry: found) {
+            buffers[entry.second] = read_buffer(maps[entry.second].get(), entry.first);
+            if (buffers[entry.second]) {
+                hits++;
+            }
+        }
+        return hits;
+    }
+
+    bool contains(const std::string &key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return index_.count(key) > 0;
+    }
+
+    // lock free negative lookup: false means fetch would miss, true means it probably hits
+    bool may_contain(std::string_view key) {
+        std::shared_ptr<BloomFilter> filter = std::atomic_load(&filter_);
+        return filter->may_contain(key);
+    }
+
+    int erase(std::string key) {
+        if (!may_contain(key)) {
+            return -1;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (index_.count(key) == 0) {
+            return -1;
+        }
+        unlink_record(key);
+        return write_record(key, nullptr, make_header(key, kTombstone, 0, NO_COMPRESSION, Freshness::forever()));
+    }
+
+    size_t get_capacity()
+    {
+        return capacity_;
+    }
+
+    size_t get_size()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return size_;
+    }
+
+    // what get_size() would be without compression
+    size_t get_raw_size()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return raw_size_;
+    }
+
+    // is_obsolete(key) == true: the key can no longer be fetched, compaction and sweeps drop its record
+    // may be called with the tier's lock held, it must not call back into the tier
+    void set_obsolete_filter(std::function<bool(const std::string &key)> is_obsolete) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        is_obsolete_ = is_obsolete;
+    }
+
+    // has the compactor drop every obsolete key on its next pass
+    void request_sweep() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sweep_requested_ = true;
+        compactor_cv_.notify_one();
+    }
+
+    // applies to records written from now on; existing records keep the codec they were written with
+    void set_compression(CompressionType type) {
+        compression_.store(type, std::memory_order_relaxed);
+    }
+};
+
+// TinyLFU frequency sketch: a count-min sketch of recent accesses per key
+// - depth_ rows of saturating 4-bit counters (kept in bytes), one hash per row; estimate = min over rows
+// - after sample_size_ increments every counter is halved, so popularity fades with time
+// - counters are relaxed atomics: a lost increment under contention only skews an estimate slightly
+// link: https://arxiv.org/abs/1512.00727
+class FrequencySketch {
+private:
+    static const int kDepth = 4;
+    static const uint8_t kMaxCount = 15;
+
+    size_t width_; // power of two
+    std::unique_ptr<std::atomic<uint8_t>[]> table_;
+    size_t sample_size_;
+    std::atomic<size_t> additions_;
+
+    static uint64_t mix(uint64_t h) {
+        // splitmix64 finalizer
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+        return h;
+    }
+
+    std::atomic<uint8_t>& counter(uint64_t hash, int row) {
+        uint64_t h = mix(hash + row * 0x9e3779b97f4a7c15ULL);
+        return table_[row * width_ + (h & (width_ - 1))];
+    }
+
+    void age() {
+        for (size_t i = 0; i < kDepth * width_; i++) {
+            table_[i].store(table_[i].load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    FrequencySketch(size_t expected_keys): width_(64), sample_size_(0), additions_(0) {
+        while (width_ < expected_keys) {
+            width_ <<= 1;
+        }
+        table_.reset(new std::atomic<uint8_t>[kDepth * width_]);
+        for (size_t i = 0; i < kDepth * width_; i++) {
+            table_[i].store(0, std::memory_order_relaxed);
+        }
+        sample_size_ = 10 * width_;
+    }
+
+    void increment(std::string_view key) {
+        uint64_t hash = std::hash<std::string_view>()(key);
+        for (int row = 0; row < kDepth; row++) {
+            std::atomic<uint8_t> &c = counter(hash, row);
+            uint8_t value = c.load(std::memory_order_relaxed);
+            if (value < kMaxCount) {
+                c.store(value + 1, std::memory_order_relaxed);
+            }
+        }
+        if (additions_.fetch_add(1, std::memory_order_relaxed) + 1 == sample_size_) {
+            age();
+            additions_.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    uint8_t estimate(std::string_view key) {
+        uint64_t hash = std::hash<std::string_view>()(key);
+        uint8_t freq = kMaxCount;
+        for (int row = 0; row < kDepth; row++) {
+            freq = std::min(freq, counter(hash, row).load(std::memory_order_relaxed));
+        }
+        return freq;
+    }
+};
+
+// successor table: learns which key tends to be fetched right after which
+// - direct mapped, one slot per predecessor hash: a slot holds the last successor seen and a 2-bit
+//   confidence that a repeat raises and a different successor lowers (replacing it at 0), so memory is
+//   fixed and one-off transitions never become predictions
+// - a transition that steps the last number in a key by one ("seg-0041" -> "seg-0042") is a sequence,
+//   and the next kSequenceDepth keys of it are predicted without having been seen before
+// - slots are guarded by striped mutexes; observe() is called on every fetch
+class SuccessorTable {
+private:
+    static constexpr uint8_t kMaxConfidence = 3;
+    static const uint8_t kPredictConfidence = 2;
+    static const size_t kStripes = 64;
+    static const int kSequenceDepth = 4;
+
+    struct Slot {
+        uint64_t from = 0; // predecessor hash, 0 = empty
+        std::string next;
+        uint8_t confidence = 0;
+    };
+
+    size_t slots_mask_;
+    std::vector<Slot> slots_;
+    std::mutex stripes_[kStripes];
+
+    static uint64_t hash_of(std::string_view key) {
+        return std::hash<std::string_view>()(key) | 1;
+    }
+
+public:
+    SuccessorTable(size_t expected_keys): slots_mask_(63) {
+        while (slots_mask_ + 1 < expected_keys) {
+            slots_mask_ = (slots_mask_ << 1) | 1;
+        }
+        slots_.resize(slots_mask_ + 1);
+    }
+
+    // key with its last run of digits incremented, width kept: "seg-0099" -> "seg-0100", "v9" -> "v10"
+    // false if the key has no digits
+    static bool next_in_sequence(std::string_view key, std::string &next) {
+        size_t end = key.size();
+        while (end > 0 && !std::isdigit(static_cast<unsigned char>(key[end - 1]))) {
+            end--;
+        }
+        if (end == 0) {
+            return false;
+        }
+        next.assign(key.data(), key.size());
+        size_t pos = end;
+        while (pos > 0 && std::isdigit(static_cast<unsigned char>(next[pos - 1]))) {
+            if (next[pos - 1] != '9') {
+                next[pos - 1]++;
+                return true;
+            }
+            next[pos - 1] = '0';
+            pos--;
+        }
+        next.insert(pos, 1, '1');
+        return true;
+    }
+
+    // records that key was fetched right after prev, and returns the keys likely to follow key
+    void observe(std::string_view prev, std::string_view key, std::vector<std::string> &predictions) {
+        predictions.clear();
+        uint64_t from = hash_of(prev);
+        size_t index = from & slots_mask_;
+        {
+            std::lock_guard<std::mutex> lock(stripes_[index % kStripes]);
+            Slot &slot = slots_[index];
+            if (slot.from == from && slot.next == key) {
+                slot.confidence = std::min<uint8_t>(slot.confidence + 1, kMaxConfidence);
+            } else if (slot.from == from && slot.confidence > 1) {
+                slot.confidence--;
+            } else {
+                slot.from = from;
+                slot.next.assign(key.data(), key.size());
+                slot.confidence = 1;
+            }
+        }
+
+        std::string next;
+        if (next_in_sequence(prev, next) && next == key) {
+            for (int i = 0; i < kSequenceDepth && next_in_sequence(next, next); i++) {
+                predictions.push_back(next);
+            }
+            return;
+        }
+        uint64_t self = hash_of(key);
+        index = self & slots_mask_;
+        std::lock_guard<std::mutex> lock(stripes_[index % kStripes]);
+        const Slot &slot = slots_[index];
+        if (slot.from == self && slot.confidence >= kPredictConfidence) {
+            predictions.push_back(slot.next);
+        }
+    }
+};
+
+// token bucket: refills at rate bytes per second up to burst bytes
+// - acquire() only needs a positive balance and charge() may overdraw it, so a caller that learns the
+//   cost of its work after doing it still pays in full, by waiting longer for the next acquire()
+class TokenBucket {
+private:
+    std::mutex mutex_;
+    double rate_;  // bytes per second, 0 = no budget
+    double burst_;
+    double tokens_;
+    std::chrono::steady_clock::time_point last_;
+
+    void refill() {
+        auto now = std::chrono::steady_clock::now();
+        tokens_ = std::min(burst_, tokens_ + rate_ * std::chrono::duration<double>(now - last_).count());
+        last_ = now;
+    }
+
+public:
+    TokenBucket(double rate, double burst): rate_(rate), burst_(burst), tokens_(burst),
+        last_(std::chrono::steady_clock::now()) {}
+
+    void reset(double rate, double burst) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rate_ = rate;
+        burst_ = burst;
+        tokens_ = std::min(tokens_, burst);
+        last_ = std::chrono::steady_clock::now();
+    }
+
+    bool acquire() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        refill();
+        return rate_ > 0 && tokens_ > 0;
+    }
+
+    void charge(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tokens_ -= bytes;
+    }
+};
+
+// lock-free latency histogram, log-linear buckets (HdrHistogram style)
+// - a value is bucketed by its highest set bit plus the kSubBits bits below it, so every bucket is
+//   at most 1/8th wide relative to its values (~12% worst case error)
+// - record() is a couple of relaxed atomic increments; snapshot() reads while writers keep going,
+//   so a snapshot is a consistent-enough view rather than an exact cut
+class LatencyHistogram {
+public:
+    static const int kSubBits = 3;
+    static const int kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+    struct Snapshot {
+        uint64_t count;
+        uint64_t sum_ns;
+        uint64_t buckets[kBuckets];
+
+        // upper bound of the bucket holding the p-th percentile (p in [0, 1])
+        uint64_t percentile(double p) const {
+            uint64_t rank = static_cast<uint64_t>(p * count);
+            uint64_t seen = 0;
+            for (int i = 0; i < kBuckets; i++) {
+                seen += buckets[i];
+                if (seen > rank) {
+                    return bucket_upper(i);
+                }
+            }
+            return count ? bucket_upper(kBuckets - 1) : 0;
+        }
+
+        uint64_t mean() const {
+            return count ? sum_ns / count : 0;
+        }
+    };
+
+private:
+    std::atomic<uint64_t> buckets_[kBuckets];
+    std::atomic<uint64_t> sum_ns_;
+
+    static int bucket_of(uint64_t value) {
+        if (value < (1ULL << kSubBits)) {
+            return static_cast<int>(value);
+        }
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - kSubBits;
+        return ((shift + 1) << kSubBits) | static_cast<int>((value >> shift) & ((1 << kSubBits) - 1));
+    }
+
+    static uint64_t bucket_upper(int bucket) {
+        int shift = (bucket >> kSubBits) - 1;
+        uint64_t sub = bucket & ((1 << kSubBits) - 1);
+        if (shift < 0) {
+            return sub;
+        }
+        return (((1ULL << kSubBits) | sub) << shift) + ((1ULL << shift) - 1);
+    }
+
+public:
+    LatencyHistogram(): sum_ns_(0) {
+        for (auto &bucket: buckets_) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // count requests that each took ns, e.g. the keys of one batch
+    void record(uint64_t ns, uint64_t count = 1) {
+        buckets_[bucket_of(ns)].fetch_add(count, std::memory_order_relaxed);
+        sum_ns_.fetch_add(ns * count, std::memory_order_relaxed);
+    }
+
+    Snapshot snapshot() const {
+        Snapshot snap;
+        snap.count = 0;
+        for (int i = 0; i < kBuckets; i++) {
+            snap.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+            snap.count += snap.buckets[i];
+        }
+        snap.sum_ns = sum_ns_.load(std::memory_order_relaxed);
+        return snap;
+    }
+};
+
+// records the time from construction to destruction into a histogram, once per request covered
+class ScopedLatency {
+private:
+    LatencyHistogram &histogram_;
+    uint64_t count_;
+    std::chrono::steady_clock::time_point start_;
+public:
+    ScopedLatency(LatencyHistogram &histogram, uint64_t count = 1):
+        histogram_(histogram),
+        count_(count),
+        start_(std::chrono::steady_clock::now())
+        {}
+
+    ~ScopedLatency() {
+        auto elapsed = std::chrono::steady_clock::now() - start_;
+        histogram_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), count_);
+    }
+};
+
+struct TierStats {
+    uint64_t hits;
+    uint64_t misses;
+    size_t size;
+    size_t capacity;
+};
+
+// point-in-time view of SmartCache, taken without pausing traffic
+struct CacheStats {
+    TierStats hot;
+    TierStats disk;
+    size_t disk_raw_size; // disk.size with compressed values counted at their original size
+    uint64_t disk_skips; // hot misses the disk bloom filter answered without a disk lookup
+    uint64_t stale_hits; // hits served stale while a refresh ran in the background
+    uint64_t origin_fetches;
+    uint64_t prefetches;      // predicted objects loaded into the tiers ahead of demand
+    uint64_t prefetch_drops;  // predictions dropped for lack of prefetch budget
+    LatencyHistogram::Snapshot fetch_latency;
+    LatencyHistogram::Snapshot store_latency;
+};
+
+class OriginFetchService {
+private:
+    size_t fake_obj_size_;
+    std::chrono::microseconds latency_; // simulated origin round trip
+    bool verbose_;
+
+    void round_trip() {
+        if (latency_.count() > 0) {
+            std::this_thread::sleep_for(latency_);
+        }
+    }
+
+    // bytes [offset, offset + len) of a fake object; position dependent so ranges can be told apart
+    static void fake_bytes(size_t offset, size_t len, std::vector<char> &bytes) {
+        bytes.resize(len);
+        for (size_t i = 0; i < len; i++) {
+            bytes[i] = static_cast<char>('a' + (offset + i) % 26);
+        }
+    }
+public:
+    OriginFetchService(size_t fake_obj_size = 1024,
+                       std::chrono::microseconds latency = std::chrono::milliseconds(10),
+                       bool verbose = true):
+        fake_obj_size_(fake_obj_size),
+        latency_(latency),
+        verbose_(verbose)
+        {}
+
+    int fetch(std::string key, std::vector<char> & bytes) {
+        if (verbose_) {
+            std::cout << "fetching obj from server: " << key << " of size  = " <<  fake_obj_size_ << std::endl;
+        }
+        round_trip();
+        fake_bytes(0, fake_obj_size_, bytes);
+        return 0; // success
+    }
+
+    // size of an object without its body, like an http HEAD request
+    int fetch_size(std::string key, size_t &size) {
+        if (verbose_) {
+            std::cout << "fetching size of obj from server: " << key << std::endl;
+        }
+        round_trip();
+        size = fake_obj_size_;
+        return 0;
+    }
+
+    // bytes [offset, offset + len) of an object, cut short at its end, like an http range request
+    int fetch_range(std::string key, size_t offset, size_t len, std::vector<char> &bytes) {
+        if (verbose_) {
+            std::cout << "fetching range [" << offset << ", " << offset + len << ") of obj from server: " << key << std::endl;
+        }
+        round_trip();
+        if (offset > fake_obj_size_) {
+            return -1;
+        }
+        fake_bytes(offset, std::min(len, fake_obj_size_ - offset), bytes);
+        return 0;
+    }
+
+    // one round trip for the whole batch; results[i] is 0 if objects[i] was fetched
+    void fetch_many(const std::vector<std::string> &keys, std::vector<std::vector<char>> &objects, std::vector<int> &results) {
+        if (verbose_) {
+            std::cout << "fetching " << keys.size() << " objs from server in one request" << std::endl;
+        }
+        round_trip();
+        objects.resize(keys.size());
+        for (auto &object: objects) {
+            fake_bytes(0, fake_obj_size_, object);
+        }
+        results.assign(keys.size(), 0);
+    }
+};
+
+// generation number per key namespace (the key up to its first '/': CacheKey's ns_ in builder.cpp)
+// - objects are cached under a tier key that carries the generation of their namespace, so bumping a
+//   generation makes everything cached under the old one unreachable in O(1), in both tiers at once
+// - a namespace that was never bumped is at generation 0 and its tier keys are the plain keys
+// - the table is persisted (tmp file + rename) on every bump: a restart must not bring back a purge
+// - lookups take a shared lock, and none at all until the first namespace is bumped
+class NamespaceGenerations {
+private:
+    std::string path_;
+    std::shared_mutex mutex_;
+    std::unordered_map<std::string, uint64_t> generations_;
+    std::atomic<bool> empty_;
+
+    // [ns_len: u32][ns bytes][generation: u64] per namespace
+    bool persist() {
+        std::string tmp_path = path_ + ".tmp";
+        int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        std::vector<char> image;
+        for (auto &entry: generations_) {
+            uint32_t ns_len = entry.first.size();
+            image.insert(image.end(), reinterpret_cast<const char*>(&ns_len), reinterpret_cast<const char*>(&ns_len) + sizeof(ns_len));
+            image.insert(image.end(), entry.first.begin(), entry.first.end());
+            image.insert(image.end(), reinterpret_cast<const char*>(&entry.second), reinterpret_cast<const char*>(&entry.second) + sizeof(uint64_t));
+        }
+        bool ok = ::write(fd, image.data(), image.size()) == static_cast<ssize_t>(image.size());
+        ok = ok && ::fsync(fd) == 0;
+        ::close(fd);
+        return ok && ::rename(tmp_path.c_str(), path_.c_str()) == 0;
+    }
+
+    void load() {
+        int fd = ::open(path_.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        std::vector<char> image;
+        char chunk[4096];
+        ssize_t n;
+        while ((n = ::read(fd, chunk, sizeof(chunk))) > 0) {
+            image.insert(image.end(), chunk, chunk + n);
+        }
+        ::close(fd);
+        size_t pos = 0;
+        while (pos + sizeof(uint32_t) <= image.size()) {
+            uint32_t ns_len;
+            std::memcpy(&ns_len, image.data() + pos, sizeof(ns_len));
+            pos += sizeof(ns_len);
+            if (pos + ns_len + sizeof(uint64_t) > image.size()) {
+                break;
+            }
+            std::string ns(image.data() + pos, ns_len);
+            pos += ns_len;
+            std::memcpy(&generations_[ns], image.data() + pos, sizeof(uint64_t));
+            pos += sizeof(uint64_t);
+        }
+    }
+
+public:
+    NamespaceGenerations(std::string path): path_(path) {
+        load();
+        empty_ = generations_.empty();
+    }
+
+    static std::string_view namespace_of(std::string_view key) {
+        return key.substr(0, key.find('/'));
+    }
+
+    uint64_t get(std::string_view ns) {
+        if (empty_.load(std::memory_order_acquire)) {
+            return 0;
+        }
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        auto it = generations_.find(std::string(ns));
+        return it == generations_.end() ? 0 : it->second;
+    }
+
+    // returns the new generation, or 0 if it could not be persisted: the bump is then undone, since a
+    // restart would undo it anyway
+    uint64_t bump(const std::string &ns) {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        uint64_t generation = ++generations_[ns];
+        if (!persist()) {
+            if (generation == 1) {
+                generations_.erase(ns);
+            } else {
+                generations_[ns]--;
+            }
+            return 0;
+        }
+        empty_.store(false, std::memory_order_release);
+        return generation;
+    }
+
+    // client keys must not contain the separators of tier keys and chunk keys
+    static bool is_client_key(std::string_view key) {
+        return key.find_first_of(std::string_view("\x01\0", 2)) == std::string_view::npos;
+    }
+
+    // the key objects under key are cached as: key, or key '\x01' generation
+    std::string tier_key(std::string_view key) {
+        uint64_t generation = get(namespace_of(key));
+        std::string tiered(key);
+        if (generation) {
+            tiered += '\x01';
+            tiered += std::to_string(generation);
+        }
+        return tiered;
+    }
+
+    // the client key a tier key (or a chunk key derived from one) was made from
+    static std::string_view client_key(std::string_view tier_key) {
+        return tier_key.substr(0, tier_key.find_first_of(std::string_view("\x01\0", 2)));
+    }
+
+    // true if the tier key belongs to a generation its namespace has moved past
+    bool is_obsolete(std::string_view tier_key) {
+        std::string_view key = tier_key.substr(0, tier_key.find('\0')); // chunks share their object's fate
+        size_t tag = key.find('\x01');
+        uint64_t generation = 0;
+        for (size_t i = tag + 1; tag != std::string_view::npos && i < key.size() && std::isdigit(static_cast<unsigned char>(key[i])); i++) {
+            generation = generation * 10 + (key[i] - '0');
+        }
+        return generation < get(namespace_of(key.substr(0, tag)));
+    }
+};
+
+// facade class: hides the complexity of hot obj cache, disk cache and ofetch from client
+// - tier placement follows access statistics: a TinyLFU sketch sees every fetch, the hot tier only
+//   evicts a victim for a new object if the new object is more popular than the victim
+// - objects evicted from the hot tier are demoted to disk, popular disk hits are promoted to memory;
+//   both moves run on a background worker, off the request path
+// - a disk copy is either absent or identical to the hot copy, so promotion copies and demotion only
+//   writes objects the disk does not already hold; a demotion is dropped if its key was stored again
+//   since the eviction, or its copy is dead or of an invalidated generation
+// - stale-while-revalidate: an expired object inside its grace window is served right away and
+//   refreshed from origin on a background thread; past the window it is dropped and fetched again
+// - objects larger than chunk_size_ are stored as a manifest under their own key plus chunks under
+//   chunk keys; each chunk is cached, admitted and evicted like any other object, and fetch_range only
+//   touches the chunks overlapping the range
+// - predictive prefetch: a successor table learns which key each client thread fetches after which,
+//   and likely next keys are loaded on a background worker, from disk into memory or from origin into
+//   the tiers; a token bucket caps the bytes it moves, predictions beyond the budget are dropped
+// - safe to share between threads: hot tier lookups take no lock, and no lock is held across tiers on
+//   the fetch path
+class SmartCache: public ICache {
+private:
+    // result of one origin fetch, shared by every caller that missed on the same key
+    struct OriginResult {
+        int res;
+        BufferHandle buffer;
+    };
+
+    enum TierMove {
+        PROMOTE,
+        DEMOTE
+    };
+
+    struct TierTask {
+        TierMove move;
+        std::string key;
+        BufferHandle buffer; // demote only
+        uint64_t ticket;     // demote only: void once the key is stored again
+    };
+
+    // value stored under the key of a chunked object
+    // a user value that looks like a manifest is chunked as well, so under a plain key a buffer of this
+    // shape always is a manifest
+    struct ChunkManifest {
+        char magic[8];
+        uint64_t total_size;
+        uint64_t chunk_size;
+        uint64_t version; // part of the chunk keys: chunks of an overwritten object are never mixed in
+    };
+
+    // a chunk key, parsed: key '\0' version '/' offset '/' len
+    // the NUL byte keeps chunk keys apart from anything a client would store
+    struct ChunkRef {
+        std::string key;
+        std::string object; // chunk key up to the offset: same object, same version
+        uint64_t offset;
+        uint64_t len;
+        size_t slot;
+    };
+
+    // disk hits seen at least this often (per the sketch) are copied into the hot tier
+    static const uint8_t kPromoteFreq = 3;
+    // tier moves (and refreshes) beyond this backlog are dropped rather than queued
+    static const size_t kMaxPendingMoves = 4096;
+    static const size_t kDefaultChunkSize = 256 * 1024;
+    // predictions beyond this backlog are dropped: a late prefetch is no better than none
+    static const size_t kMaxPendingPrefetches = 64;
+    static const size_t kDefaultPrefetchRate = 16 << 20; // bytes per second
+    static const size_t kDefaultPrefetchBurst = 1 << 20;
+
+    // the last key a thread fetched from a cache, to learn successors per client thread
+    struct FetchStream {
+        const SmartCache *cache = nullptr;
+        std::string key;
+    };
+
+    HotObjectCache *hot_obj_cache_;
+    DiskCache *disk_cache_;
+    OriginFetchService *ofetch_service_;
+    FrequencySketch sketch_;
+    // stores, promotions and demotions of one key are serialized on its stripe, so a tier move cannot
+    // put older bytes over a concurrent store; lookups take no stripe
+    static const size_t kKeyStripes = 256;
+    std::mutex key_stripes_[kKeyStripes];
+    // queued demotions per key, by stripe: a store drops the key's ticket, so a demotion can tell that
+    // the copy it carries was replaced while it sat in the queue
+    struct DemotionStripe {
+        std::mutex mutex; // taken last, also from the hot tier's eviction path
+        std::unordered_map<std::string, uint64_t> tickets;
+    };
+    DemotionStripe demotions_[kKeyStripes];
+    uint64_t next_ticket_; // under tier_mutex_
+    std::mutex inflight_mutex_;
+    std::unordered_map<std::string, std::shared_future<OriginResult>> inflight_;
+
+    std::atomic<uint64_t> hot_hits_;
+    std::atomic<uint64_t> hot_misses_;
+    std::atomic<uint64_t> disk_hits_;
+    std::atomic<uint64_t> disk_misses_;
+    std::atomic<uint64_t> disk_skips_;
+    std::atomic<uint64_t> stale_hits_;
+    std::atomic<uint64_t> origin_fetches_;
+    LatencyHistogram fetch_latency_;
+    LatencyHistogram store_latency_;
+
+    std::mutex tier_mutex_;
+    std::condition_variable tier_cv_;
+    std::deque<TierTask> tier_tasks_;
+    std::unordered_set<std::string> promoting_;
+    std::deque<std::string> refresh_tasks_;
+    std::unordered_set<std::string> refreshing_;
+    bool stop_;
+    std::thread tier_worker_;
+    std::thread refresh_worker_; // separate from tier_worker_ so origin round trips never delay tier moves
+    std::deque<std::string> prefetch_tasks_; // client keys
+    std::unordered_set<std::string> prefetching_;
+    std::thread prefetch_worker_;
+
+    // freshness given to objects filled from origin, 0 ttl = never expire
+    std::chrono::milliseconds origin_ttl_;
+    std::chrono::milliseconds origin_grace_;
+
+    size_t chunk_size_;
+    std::atomic<uint64_t> next_chunk_version_;
+
+    // every public entry point maps client keys to tier keys, everything below works on tier keys
+    NamespaceGenerations generations_;
+
+    SuccessorTable successors_;
+    TokenBucket prefetch_budget_;
+    std::atomic<bool> prefetch_enabled_;
+    std::atomic<uint64_t> prefetches_;
+    std::atomic<uint64_t> prefetch_drops_;
+
+    Freshness origin_freshness() {
+        return origin_ttl_.count() ? Freshness::ttl(origin_ttl_, origin_grace_) : Freshness::forever();
+    }
+
+    static bool is_chunk_key(std::string_view key) {
+        return key.find('\0') != std::string_view::npos;
+    }
+
+    static std::string chunk_key(const std::string &key, uint64_t version, uint64_t offset, uint64_t len) {
+        std::string chunk = key;
+        chunk += '\0';
+        chunk += std::to_string(version) + "/" + std::to_string(offset) + "/" + std::to_string(len);
+        return chunk;
+    }
+
+    static bool parse_chunk_key(const std::string &chunk, ChunkRef &ref) {
+        size_t sep = chunk.find('\0');
+        size_t offset_pos = (sep == std::string::npos) ? sep : chunk.find('/', sep);
+        size_t len_pos = (offset_pos == std::string::npos) ? offset_pos : chunk.find('/', offset_pos + 1);
+        if (len_pos == std::string::npos) {
+            return false;
+        }
+        const char *end = chunk.data() + chunk.size();
+        auto offset = std::from_chars(chunk.data() + offset_pos + 1, chunk.data() + len_pos, ref.offset);
+        auto len = std::from_chars(chunk.data() + len_pos + 1, end, ref.len);
+        if (offset.ec != std::errc() || offset.ptr != chunk.data() + len_pos || len.ec != std::errc() || len.ptr != end) {
+            return false;
+        }
+        ref.key = chunk.substr(0, sep);
+        ref.object = chunk.substr(0, offset_pos);
+        return true;
+    }
+
+    static bool parse_manifest(const BufferHandle &buffer, ChunkManifest &manifest) {
+        if (buffer->size() != sizeof(ChunkManifest) || std::memcmp(buffer->data(), "SCCHUNKS", 8) != 0) {
+            return false;
+        }
+        std::memcpy(&manifest, buffer->data(), sizeof(manifest));
+        return manifest.chunk_size > 0;
+    }
+
+    ChunkManifest new_manifest(uint64_t total_size) {
+        ChunkManifest manifest;
+        std::memcpy(manifest.magic, "SCCHUNKS", sizeof(manifest.magic));
+        manifest.total_size = total_size;
+        manifest.chunk_size = chunk_size_;
+        manifest.version = next_chunk_version_.fetch_add(1, std::memory_order_relaxed);
+        return manifest;
+    }
+
+    static BufferHandle manifest_buffer(const ChunkManifest &manifest, const Freshness &freshness) {
+        const char *bytes = reinterpret_cast<const char*>(&manifest);
+        return make_buffer(std::vector<char>(bytes, bytes + sizeof(manifest)), freshness);
+    }
+
+    // keys of the chunks overlapping [offset, offset + len), len > 0
+    static std::vector<std::string> chunk_keys(const std::string &key, const ChunkManifest &manifest,
+                                               uint64_t offset, uint64_t len) {
+        std::vector<std::string> keys;
+        for (uint64_t begin = offset / manifest.chunk_size * manifest.chunk_size; begin < offset + len;
+             begin += manifest.chunk_size) {
+            keys.push_back(chunk_key(key, manifest.version, begin, std::min(manifest.chunk_size, manifest.total_size - begin)));
+        }
+        return keys;
+    }
+
+    bool needs_chunking(std::string_view key, const BufferHandle &buffer) {
+        ChunkManifest manifest;
+        return !is_chunk_key(key) && (buffer->size() > chunk_size_ || parse_manifest(buffer, manifest));
+    }
+
+    // chunks first, then the manifest, so a reader that finds the manifest finds the chunks as well
+    int store_chunked(const std::string &key, const BufferHandle &buffer) {
+        ChunkManifest manifest = new_manifest(buffer->size());
+        std::vector<std::string> keys = chunk_keys(key, manifest, 0, buffer->size());
+        std::vector<std::string_view> key_views(keys.begin(), keys.end());
+        std::vector<BufferHandle> chunks;
+        for (uint64_t begin = 0; begin < buffer->size(); begin += manifest.chunk_size) {
+            const char *data = buffer->data() + begin;
+            size_t len = std::min<uint64_t>(manifest.chunk_size, buffer->size() - begin);
+            chunks.push_back(make_buffer(std::vector<char>(data, data + len), buffer->freshness()));
+        }
+        if (store_many_objects(key_views, chunks) != chunks.size()) {
+            return -1;
+        }
+        return store_object(key, manifest_buffer(manifest, buffer->freshness()));
+    }
+
+    // [offset, offset + len) of a chunked object, len > 0; missing chunks come from origin as range requests
+    int fetch_chunks(const std::string &key, const ChunkManifest &manifest, uint64_t offset, uint64_t len,
+                     std::vector<char> &bytes) {
+        std::vector<std::string> keys = chunk_keys(key, manifest, offset, len);
+        std::vector<std::string_view> key_views(keys.begin(), keys.end());
+        std::vector<BufferHandle> chunks;
+        if (fetch_many_objects(key_views, chunks) != chunks.size()) {
+            return -1;
+        }
+        bytes.clear();
+        bytes.reserve(len);
+        uint64_t chunk_begin = offset / manifest.chunk_size * manifest.chunk_size;
+        for (auto &chunk: chunks) {
+            uint64_t from = std::max(offset, chunk_begin) - chunk_begin;
+            uint64_t to = std::min<uint64_t>(offset + len - chunk_begin, chunk->size());
+            if (from < to) {
+                bytes.insert(bytes.end(), chunk->data() + from, chunk->data() + to);
+            }
+            chunk_begin += manifest.chunk_size;
+        }
+        return bytes.size() == len ? 0 : -1;
+    }
+
+    // replaces a manifest fetched from a tier with the object it describes
+    int assemble(const std::string &key, BufferHandle &buffer) {
+        ChunkManifest manifest;
+        if (is_chunk_key(key) || !parse_manifest(buffer, manifest)) {
+            return 0;
+        }
+        std::vector<char> bytes;
+        if (fetch_chunks(key, manifest, 0, manifest.total_size, bytes) != 0) {
+            buffer = nullptr;
             return -1;
         }
-        std::cout << "HotObjCache: storing obj in memory: " << key << " of size  = " <<  bytes.size() << std::endl;
-        size_ += bytes.size();
-        return 0; // success
+        buffer = make_buffer(std::move(bytes), buffer->freshness());
+        return 0;
     }
 
+    // one origin round trip for the plain keys, and one range request per run of adjacent chunks of
+    // the same object
+    void origin_load(const std::vector<std::string> &keys, std::vector<std::vector<char>> &objects, std::vector<int> &res) {
+        objects.assign(keys.size(), std::vector<char>());
+        res.assign(keys.size(), -1);
+        std::vector<std::string> plain_keys;
+        std::vector<size_t> plain_slots;
+        std::vector<ChunkRef> chunks;
+        for (size_t i = 0; i < keys.size(); i++) {
+            ChunkRef ref;
+            if (parse_chunk_key(keys[i], ref)) {
+                ref.slot = i;
+                chunks.push_back(std::move(ref));
+            } else {
+                plain_keys.push_back(std::string(NamespaceGenerations::client_key(keys[i])));
+                plain_slots.push_back(i);
+            }
+        }
 
-    int fetch(std::string key, std::vector<char> & bytes) {
-        if (bytes.size() > capacity_) {
-            return -1;
+        if (plain_keys.size() == 1) {
+            res[plain_slots[0]] = ofetch_service_->fetch(plain_keys[0], objects[plain_slots[0]]);
+        } else if (!plain_keys.empty()) {
+            std::vector<std::vector<char>> plain_objects;
+            std::vector<int> plain_res;
+            ofetch_service_->fetch_many(plain_keys, plain_objects, plain_res);
+            for (size_t i = 0; i < plain_slots.size(); i++) {
+                objects[plain_slots[i]] = std::move(plain_objects[i]);
+                res[plain_slots[i]] = plain_res[i];
+            }
+        }
+
+        std::sort(chunks.begin(), chunks.end(), [](const ChunkRef &a, const ChunkRef &b) {
+            return a.object != b.object ? a.object < b.object : a.offset < b.offset;
+        });
+        for (size_t begin = 0; begin < chunks.size();) {
+            size_t end = begin + 1;
+            uint64_t run_end = chunks[begin].offset + chunks[begin].len;
+            while (end < chunks.size() && chunks[end].object == chunks[begin].object && chunks[end].offset == run_end) {
+                run_end += chunks[end].len;
+                end++;
+            }
+            std::vector<char> run;
+            std::string origin_key(NamespaceGenerations::client_key(chunks[begin].key));
+            if (ofetch_service_->fetch_range(origin_key, chunks[begin].offset, run_end - chunks[begin].offset, run) == 0) {
+                for (size_t i = begin; i < end; i++) {
+                    uint64_t from = chunks[i].offset - chunks[begin].offset;
+                    if (from + chunks[i].len <= run.size()) {
+                        objects[chunks[i].slot].assign(run.begin() + from, run.begin() + from + chunks[i].len);
+                        res[chunks[i].slot] = 0;
+                    }
+                }
+            }
+            begin = end;
         }
-        size_t fake_obj_size = 1024;
-        std::cout << "HotObjCache: fetching obj from memory: " << key << " of size  = " <<  fake_obj_size << std::endl;
-        return 0; // success
     }
 
-    size_t get_capacity()
-    {
-        return capacity_;
+    // single flight: the first caller to miss on a key fetches it from origin and fills the cache,
+    // concurrent callers for the same key wait on that fetch instead of issuing their own
+    // keys nobody else is fetching go out to origin as one batched request
+    void fetch_many_from_origin(const std::vector<std::string> &keys, std::vector<BufferHandle> &buffers) {
+        std::vector<std::promise<OriginResult>> promises;
+        std::vector<std::string> lead_keys;
+        std::vector<std::shared_future<OriginResult>> results(keys.size());
+        {
+            std::lock_guard<std::mutex> lock(inflight_mutex_);
+            promises.reserve(keys.size());
+            for (size_t i = 0; i < keys.size(); i++) {
+                auto it = inflight_.find(keys[i]);
+                if (it != inflight_.end()) {
+                    results[i] = it->second;
+                } else {
+                    promises.emplace_back();
+                    results[i] = promises.back().get_future().share();
+                    inflight_[keys[i]] = results[i];
+                    lead_keys.push_back(keys[i]);
+                }
+            }
+        }
+
+        if (!lead_keys.empty()) {
+            std::vector<std::vector<char>> objects;
+            std::vector<int> res;
+            origin_fetches_.fetch_add(lead_keys.size(), std::memory_order_relaxed);
+            origin_load(lead_keys, objects, res);
+            std::vector<std::string_view> fill_keys;
+            std::vector<BufferHandle> fill_buffers;
+            std::vector<OriginResult> fetched(lead_keys.size());
+            Freshness freshness = origin_freshness();
+            for (size_t i = 0; i < lead_keys.size(); i++) {
+                fetched[i].res = res[i];
+                if (res[i] == 0) {
+                    fetched[i].buffer = make_buffer(std::move(objects[i]), freshness);
+                    fill_keys.push_back(lead_keys[i]);
+                    fill_buffers.push_back(fetched[i].buffer);
+                }
+            }
+            store_many_tiered(fill_keys, fill_buffers);
+            for (size_t i = 0; i < lead_keys.size(); i++) {
+                promises[i].set_value(std::move(fetched[i]));
+            }
+            std::lock_guard<std::mutex> lock(inflight_mutex_);
+            for (auto &key: lead_keys) {
+                inflight_.erase(key);
+            }
+        }
+
+        buffers.assign(keys.size(), nullptr);
+        for (size_t i = 0; i < keys.size(); i++) {
+            const OriginResult &fetched = results[i].get();
+            if (fetched.res == 0) {
+                buffers[i] = fetched.buffer;
+            }
+        }
     }
 
-    size_t get_size()
-    {
-        return size_;
+    int fetch_from_origin(const std::string &key, BufferHandle &buffer) {
+        std::vector<BufferHandle> buffers;
+        fetch_many_from_origin(std::vector<std::string>(1, key), buffers);
+        buffer = buffers[0];
+        return buffer ? 0 : -1;
     }
-};
 
-class DiskCache: public ICache {
-private:
-    size_t capacity_;
-    size_t size_;
-public:
-    DiskCache(size_t capacity): capacity_(capacity), size_(0) {}
-    int store(std::string key, std::vector<char> bytes) {
-        if (size_ + bytes.size() > capacity_) {
-            return -1;
+    // first touch of an object by a range fetch, single flight on the same inflight_ table: the first
+    // caller sizes the object at origin, then fetches a small one whole or caches a new manifest for a
+    // large one; concurrent callers (range or whole object fetches) share that buffer, so an object gets
+    // one manifest version and one set of chunks
+    int open_from_origin(const std::string &key, const std::string &client_key, BufferHandle &buffer) {
+        std::promise<OriginResult> promise;
+        std::shared_future<OriginResult> result;
+        bool lead = false;
+        {
+            std::lock_guard<std::mutex> lock(inflight_mutex_);
+            auto it = inflight_.find(key);
+            if (it != inflight_.end()) {
+                result = it->second;
+            } else {
+                result = promise.get_future().share();
+                inflight_[key] = result;
+                lead = true;
+            }
         }
-        std::cout << "storing obj on disk: " << key << " of size  = " <<  bytes.size() << std::endl;
-        size_ += bytes.size();
-        return 0; // success
+
+        if (lead) {
+            OriginResult opened = {-1, nullptr};
+            size_t size;
+            origin_fetches_.fetch_add(1, std::memory_order_relaxed);
+            if (ofetch_service_->fetch_size(client_key, size) == 0) {
+                if (size <= chunk_size_) {
+                    std::vector<std::vector<char>> objects;
+                    std::vector<int> res;
+                    origin_fetches_.fetch_add(1, std::memory_order_relaxed);
+                    origin_load(std::vector<std::string>(1, key), objects, res);
+                    if (res[0] == 0) {
+                        opened = {0, make_buffer(std::move(objects[0]), origin_freshness())};
+                    }
+                } else {
+                    opened = {0, manifest_buffer(new_manifest(size), origin_freshness())};
+                }
+                if (opened.res == 0) {
+                    store_object(key, opened.buffer);
+                }
+            }
+            promise.set_value(std::move(opened));
+            std::lock_guard<std::mutex> lock(inflight_mutex_);
+            inflight_.erase(key);
+        }
+
+        const OriginResult &opened = result.get();
+        buffer = opened.buffer;
+        return opened.res;
     }
 
+    static size_t stripe_of(std::string_view key) {
+        return std::hash<std::string_view>()(key) % kKeyStripes;
+    }
 
-    int fetch(std::string key, std::vector<char> & bytes) {
-        size_t fake_obj_size = 1024;
-        std::cout << "fetching obj from disk: " << key << " of size  = " <<  fake_obj_size << std::endl;
-        return 0; // success
+    std::mutex& key_stripe(std::string_view key) {
+        return key_stripes_[stripe_of(key)];
     }
 
-    size_t get_capacity()
-    {
-        return capacity_;
+    // called with the key's stripe held, once the store has reached its tier: a copy of the key evicted
+    // before this point is outdated
+    void void_demotion(std::string_view key) {
+        DemotionStripe &stripe = demotions_[stripe_of(key)];
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        if (!stripe.tickets.empty()) {
+            stripe.tickets.erase(std::string(key));
+        }
     }
 
-    size_t get_size()
-    {
-        return size_;
+    // locks the stripes of a batch in index order, so two batches cannot deadlock each other
+    void lock_key_stripes(const std::vector<std::string_view> &keys, std::vector<std::unique_lock<std::mutex>> &locks) {
+        std::vector<size_t> stripes;
+        for (auto key: keys) {
+            stripes.push_back(stripe_of(key));
+        }
+        std::sort(stripes.begin(), stripes.end());
+        stripes.erase(std::unique(stripes.begin(), stripes.end()), stripes.end());
+        for (auto stripe: stripes) {
+            locks.emplace_back(key_stripes_[stripe]);
+        }
     }
-};
 
-class OriginFetchService {
-public:
-    int fetch(std::string key, std::vector<char> & bytes) {
-        size_t fake_obj_size = 1024;
-        std::cout << "fetching obj from server: " << key << " of size  = " <<  fake_obj_size << std::endl;
-        return 0; // success
+    // called with a hot tier shard locked, from the hot tier's eviction path
+    // the ticket is handed out here, not when the task runs: a store after this point outdates the buffer
+    void schedule_demotion(const std::string &key, BufferHandle buffer) {
+        std::lock_guard<std::mutex> lock(tier_mutex_);
+        if (tier_tasks_.size() >= kMaxPendingMoves) {
+            return;
+        }
+        uint64_t ticket = ++next_ticket_;
+        DemotionStripe &stripe = demotions_[stripe_of(key)];
+        {
+            std::lock_guard<std::mutex> stripe_lock(stripe.mutex);
+            stripe.tickets[key] = ticket; // an earlier demotion of the key still queued is void now
+        }
+        tier_tasks_.push_back(TierTask{DEMOTE, key, std::move(buffer), ticket});
+        tier_cv_.notify_all();
+    }
+
+    void schedule_promotion(const std::string &key) {
+        std::lock_guard<std::mutex> lock(tier_mutex_);
+        if (tier_tasks_.size() >= kMaxPendingMoves || !promoting_.insert(key).second) {
+            return;
+        }
+        tier_tasks_.push_back(TierTask{PROMOTE, key, {}, 0});
+        tier_cv_.notify_all();
+    }
+
+    // returns the bytes read from disk
+    size_t promote(const std::string &key) {
+        // the disk read happens under the key's stripe so a concurrent store cannot be overwritten by older bytes
+        std::lock_guard<std::mutex> lock(key_stripe(key));
+        BufferHandle buffer;
+        if (hot_obj_cache_->contains(key) || disk_cache_->fetch_buffer(key, buffer) != 0) {
+            return 0;
+        }
+        hot_obj_cache_->store_buffer(key, buffer);
+        return buffer->size();
+    }
+
+    // writes an evicted buffer to disk, unless the key was stored (or evicted again) since, the buffer
+    // can no longer be served, or the disk already holds it: with no store in between, a disk record
+    // of the key is the one the hot copy was promoted from
+    void demote(const std::string &key, const BufferHandle &buffer, uint64_t ticket) {
+        std::lock_guard<std::mutex> lock(key_stripe(key));
+        DemotionStripe &stripe = demotions_[stripe_of(key)];
+        {
+            std::lock_guard<std::mutex> stripe_lock(stripe.mutex);
+            auto it = stripe.tickets.find(key);
+            if (it == stripe.tickets.end() || it->second != ticket) {
+                return;
+            }
+            stripe.tickets.erase(it);
+        }
+        if (buffer->freshness().state(now_ms()) == Freshness::DEAD || generations_.is_obsolete(key)
+            || hot_obj_cache_->contains(key) || disk_cache_->contains(key)) {
+            return;
+        }
+        disk_cache_->store_buffer(key, buffer);
+    }
+
+    void schedule_refresh(const std::string &key) {
+        std::lock_guard<std::mutex> lock(tier_mutex_);
+        if (refresh_tasks_.size() >= kMaxPendingMoves || !refreshing_.insert(key).second) {
+            return;
+        }
+        refresh_tasks_.push_back(key);
+        tier_cv_.notify_all();
+    }
+
+    // learns from the fetch of client_key by this thread and queues prefetches for its likely successors
+    void observe_fetch(std::string_view client_key) {
+        static thread_local FetchStream stream;
+        if (!prefetch_enabled_.load(std::memory_order_relaxed)) {
+            return;
+        }
+        if (stream.cache == this) {
+            std::vector<std::string> predictions;
+            successors_.observe(stream.key, client_key, predictions);
+            for (auto &next: predictions) {
+                schedule_prefetch(next);
+            }
+        }
+        stream.cache = this;
+        stream.key.assign(client_key.data(), client_key.size());
+    }
+
+    void schedule_prefetch(const std::string &client_key) {
+        if (hot_obj_cache_->contains(generations_.tier_key(client_key))) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(tier_mutex_);
+        if (prefetch_tasks_.size() >= kMaxPendingPrefetches || !prefetching_.insert(client_key).second) {
+            return;
+        }
+        prefetch_tasks_.push_back(client_key);
+        tier_cv_.notify_all();
+    }
+
+    // loads predicted objects: disk copies are promoted, the rest comes from origin in one batch and
+    // lands in whichever tier admits it; origin loads go through the single flight table, so a demand
+    // miss on a key being prefetched waits for the prefetch instead of fetching twice
+    void prefetch(const std::vector<std::string> &client_keys) {
+        size_t bytes = 0;
+        std::vector<std::string> origin_keys;
+        for (auto &client_key: client_keys) {
+            std::string key = generations_.tier_key(client_key);
+            if (hot_obj_cache_->contains(key)) {
+                continue;
+            }
+            if (disk_cache_->contains(key)) {
+                bytes += promote(key);
+            } else {
+                origin_keys.push_back(std::move(key));
+            }
+            prefetches_.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (!origin_keys.empty()) {
+            std::vector<BufferHandle> buffers;
+            fetch_many_from_origin(origin_keys, buffers);
+            for (auto &buffer: buffers) {
+                bytes += buffer ? buffer->size() : 0;
+            }
+        }
+        prefetch_budget_.charge(bytes);
+    }
+
+    // decides whether a tier hit may be served: false for dead objects, which the caller drops
+    // a stale object is served, with a background refresh scheduled for it
+    bool servable(const std::string &key, const BufferHandle &buffer) {
+        switch (buffer->freshness().state(now_ms())) {
+        case Freshness::FRESH:
+            return true;
+        case Freshness::STALE:
+            stale_hits_.fetch_add(1, std::memory_order_relaxed);
+            schedule_refresh(key);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // drop a dead copy found by a lookup; the lookup took no stripe, so a store may have replaced the copy
+    // since: the erase runs under the key's stripe and only if what the tier holds now is still dead
+    void erase_dead_hot(const std::string &key) {
+        std::lock_guard<std::mutex> lock(key_stripe(key));
+        BufferHandle buffer;
+        if (hot_obj_cache_->fetch_buffer(key, buffer) == 0 && buffer->freshness().state(now_ms()) == Freshness::DEAD) {
+            hot_obj_cache_->erase(key);
+        }
+    }
+
+    void erase_dead_disk(const std::string &key) {
+        std::lock_guard<std::mutex> lock(key_stripe(key));
+        BufferHandle buffer;
+        if (disk_cache_->fetch_buffer(key, buffer) == 0 && buffer->freshness().state(now_ms()) == Freshness::DEAD) {
+            disk_cache_->erase(key);
+        }
+    }
+
+    // probes the hot tier, dropping a dead copy
+    int fetch_hot(const std::string &key, BufferHandle &buffer) {
+        if (hot_obj_cache_->fetch_buffer(key, buffer) != 0) {
+            return -1;
+        }
+        if (!servable(key, buffer)) {
+            erase_dead_hot(key);
+            buffer = nullptr;
+            return -1;
+        }
+        return 0;
+    }
+
+    // refresh goes through the single flight table, so it also coalesces with demand misses
+    void refresh_worker_loop() {
+        std::unique_lock<std::mutex> lock(tier_mutex_);
+        while (true) {
+            tier_cv_.wait(lock, [this]() { return stop_ || !refresh_tasks_.empty(); });
+            if (stop_) {
+                return;
+            }
+            std::string key = std::move(refresh_tasks_.front());
+            refresh_tasks_.pop_front();
+            lock.unlock();
+            std::vector<BufferHandle> buffers;
+            fetch_many_from_origin(std::vector<std::string>(1, key), buffers);
+            lock.lock();
+            refreshing_.erase(key);
+        }
+    }
+
+    // takes the whole backlog at once, so predictions made while an origin trip was out share the next one
+    // predictions the budget has no room for right now are dropped, not delayed
+    void prefetch_worker_loop() {
+        std::unique_lock<std::mutex> lock(tier_mutex_);
+        while (true) {
+            tier_cv_.wait(lock, [this]() { return stop_ || !prefetch_tasks_.empty(); });
+            if (stop_) {
+                return;
+            }
+            std::vector<std::string> keys(std::make_move_iterator(prefetch_tasks_.begin()),
+                                          std::make_move_iterator(prefetch_tasks_.end()));
+            prefetch_tasks_.clear();
+            lock.unlock();
+            if (prefetch_budget_.acquire()) {
+                prefetch(keys);
+            } else {
+                prefetch_drops_.fetch_add(keys.size(), std::memory_order_relaxed);
+            }
+            lock.lock();
+            for (auto &key: keys) {
+                prefetching_.erase(key);
+            }
+        }
+    }
+
+    void tier_worker_loop() {
+        std::unique_lock<std::mutex> lock(tier_mutex_);
+        while (true) {
+            tier_cv_.wait(lock, [this]() { return stop_ || !tier_tasks_.empty(); });
+            if (stop_) {
+                return;
+            }
+            TierTask task = std::move(tier_tasks_.front());
+            tier_tasks_.pop_front();
+            lock.unlock();
+            if (task.move == PROMOTE) {
+                promote(task.key);
+            } else {
+                demote(task.key, task.buffer, task.ticket);
+            }
+            lock.lock();
+            if (task.move == PROMOTE) {
+                promoting_.erase(task.key);
+            }
+        }
     }
-};
 
-// facade class: hides the complexity of hot obj cache, disk cache and ofetch from client
-class SmartCache: public ICache {
-private:
-    HotObjectCache *hot_obj_cache_;
-    DiskCache *disk_cache_;
-    OriginFetchService *ofetch_service_;
 public:
-    SmartCache(size_t hot_obj_capacity, size_t disk_cache_capacity) {
+    // SmartCache takes ownership of ofetch_service, a default origin is used if none is given
+    SmartCache(size_t hot_obj_capacity, size_t disk_cache_capacity, OriginFetchService *ofetch_service = nullptr,
+               std::string disk_dir = "smartcache_disk"):
+        sketch_(std::max<size_t>(hot_obj_capacity / 256, 1024)),
+        next_ticket_(0),
+        hot_hits_(0),
+        hot_misses_(0),
+        disk_hits_(0),
+        disk_misses_(0),
+        disk_skips_(0),
+        stale_hits_(0),
+        origin_fetches_(0),
+        stop_(false),
+        origin_ttl_(0),
+        origin_grace_(0),
+        chunk_size_(kDefaultChunkSize),
+        next_chunk_version_(static_cast<uint64_t>(now_ms()) << 16), // distinct from chunks left on disk by an earlier run
+        generations_(disk_dir + "/namespaces.gen"),
+        successors_(std::max<size_t>(hot_obj_capacity / 1024, 1024)),
+        prefetch_budget_(kDefaultPrefetchRate, kDefaultPrefetchBurst),
+        prefetch_enabled_(true),
+        prefetches_(0),
+        prefetch_drops_(0)
+    {
         hot_obj_cache_ = new HotObjectCache(hot_obj_capacity);
-        disk_cache_ = new DiskCache(disk_cache_capacity);
-        ofetch_service_ = new OriginFetchService();
+        disk_cache_ = new DiskCache(disk_cache_capacity, disk_dir);
+        ofetch_service_ = ofetch_service ? ofetch_service : new OriginFetchService();
+        disk_cache_->set_obsolete_filter([this](const std::string &key) {
+            return generations_.is_obsolete(key);
+        });
+
+        hot_obj_cache_->set_admission_policy([this](const std::string &candidate, const std::string &victim) {
+            return sketch_.estimate(candidate) > sketch_.estimate(victim);
+        });
+        hot_obj_cache_->set_evict_listener([this](const std::string &key, BufferHandle buffer) {
+            schedule_demotion(key, std::move(buffer));
+        });
+        tier_worker_ = std::thread(&SmartCache::tier_worker_loop, this);
+        refresh_worker_ = std::thread(&SmartCache::refresh_worker_loop, this);
+        prefetch_worker_ = std::thread(&SmartCache::prefetch_worker_loop, this);
+    }
+
+    // objects filled from origin expire after ttl and may be served stale for grace after that
+    void set_origin_ttl(std::chrono::milliseconds ttl, std::chrono::milliseconds grace) {
+        origin_ttl_ = ttl;
+        origin_grace_ = grace;
+    }
+
+    // objects larger than this are stored in chunks of this size
+    void set_chunk_size(size_t chunk_size) {
+        chunk_size_ = std::max<size_t>(chunk_size, 1);
+    }
+
+    // prefetch moves at most bytes_per_sec on average, in bursts of up to burst bytes; 0 turns it off
+    void set_prefetch_budget(size_t bytes_per_sec, size_t burst) {
+        prefetch_budget_.reset(bytes_per_sec, burst);
+        prefetch_enabled_.store(bytes_per_sec > 0, std::memory_order_relaxed);
+    }
+
+    // compress what lands in the disk tier (demotions, hot tier rejects, batch stores); the hot tier
+    // keeps objects uncompressed, so only disk hits pay for decompression
+    void set_disk_compression(CompressionType type) {
+        disk_cache_->set_compression(type);
+    }
+
+    ~SmartCache() {
+        {
+            std::lock_guard<std::mutex> lock(tier_mutex_);
+            stop_ = true;
+        }
+        tier_cv_.notify_all();
+        tier_worker_.join();
+        refresh_worker_.join();
+        prefetch_worker_.join();
+        delete hot_obj_cache_;
+        delete disk_cache_;
+        delete ofetch_service_;
     }
 
     int store(std::string key, std::vector<char> bytes) {
+        return store_buffer(key, make_buffer(std::move(bytes)));
+    }
+
+
+    int fetch(std::string key, std::vector<char> & bytes) {
+        BufferHandle buffer;
+        int res = fetch_buffer(key, buffer);
+        if (res == 0) {
+            bytes.assign(buffer->data(), buffer->data() + buffer->size());
+        }
+        return res;
+    }
+
+private:
+    // store/fetch of single tier objects: whole objects, manifests and chunks alike
+    int store_object(const std::string &key, BufferHandle buffer) {
+        std::lock_guard<std::mutex> stripe(key_stripe(key));
         // check hot obj cache
-        int res = hot_obj_cache_->store(key, bytes);
+        int res = hot_obj_cache_->store_buffer(key, buffer);
         if (res == 0) {
+            disk_cache_->erase(key); // drop the now outdated disk copy
+            void_demotion(key);
             return 0;
         }
         // check disk cache
-        res = disk_cache_->store(key, bytes);
+        res = disk_cache_->store_buffer(key, buffer);
+        // not admitted to memory: make sure no older hot copy outlives this store
+        hot_obj_cache_->erase(key);
+        void_demotion(key);
         if (res == 0) {
             return 0;
         }
-        return -1; // success
+        return -1; // neither tier took it
     }
 
-
-    int fetch(std::string key, std::vector<char> & bytes) {
+    // misses go to origin only if use_origin is set
+    int fetch_object(const std::string &key, BufferHandle &buffer, bool use_origin) {
+        sketch_.increment(key);
         // check hot obj cache
-        int res = hot_obj_cache_->fetch(key, bytes);
+        int res = fetch_hot(key, buffer);
         if (res == 0) {
+            hot_hits_.fetch_add(1, std::memory_order_relaxed);
             return 0;
         }
-        // check disk cache
-        res = disk_cache_->fetch(key, bytes);
+        hot_misses_.fetch_add(1, std::memory_order_relaxed);
+        // check disk cache, unless its bloom filter rules the key out
+        if (!disk_cache_->may_contain(key)) {
+            disk_skips_.fetch_add(1, std::memory_order_relaxed);
+            res = -1;
+        } else {
+            res = disk_cache_->fetch_buffer(key, buffer);
+            if (res == 0 && !servable(key, buffer)) {
+                erase_dead_disk(key);
+                res = -1;
+            }
+        }
         if (res == 0) {
+            disk_hits_.fetch_add(1, std::memory_order_relaxed);
+            if (sketch_.estimate(key) >= kPromoteFreq) {
+                schedule_promotion(key);
+            }
+            return 0;
+        }
+        disk_misses_.fetch_add(1, std::memory_order_relaxed);
+
+        return use_origin ? fetch_from_origin(key, buffer) : -1;
+    }
+
+    // batched store: whatever memory does not admit goes to disk as one batch
+    size_t store_many_objects(const std::vector<std::string_view> &keys, const std::vector<BufferHandle> &buffers) {
+        std::vector<std::unique_lock<std::mutex>> stripes;
+        lock_key_stripes(keys, stripes);
+        std::vector<std::string_view> disk_keys;
+        std::vector<BufferHandle> disk_buffers;
+        std::vector<std::string_view> hot_keys;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (hot_obj_cache_->store_buffer(keys[i], buffers[i]) == 0) {
+                hot_keys.push_back(keys[i]);
+            } else {
+                disk_keys.push_back(keys[i]);
+                disk_buffers.push_back(buffers[i]);
+            }
+        }
+        for (auto key: hot_keys) {
+            disk_cache_->erase(std::string(key)); // drop the now outdated disk copy
+        }
+        size_t stored = hot_keys.size();
+        if (!disk_keys.empty()) {
+            stored += disk_cache_->store_many(disk_keys, disk_buffers);
+            // not admitted to memory: make sure no older hot copy outlives this store
+            for (auto key: disk_keys) {
+                hot_obj_cache_->erase(std::string(key));
+            }
+        }
+        for (auto key: keys) {
+            void_demotion(key);
+        }
+        return stored;
+    }
+
+    // batched fetch: every key probes the hot tier, the misses go to disk as one batched read, and
+    // whatever is still missing goes to origin as one coalesced request
+    size_t fetch_many_objects(const std::vector<std::string_view> &keys, std::vector<BufferHandle> &buffers) {
+        buffers.assign(keys.size(), nullptr);
+        std::vector<size_t> hot_miss;
+        for (size_t i = 0; i < keys.size(); i++) {
+            sketch_.increment(keys[i]);
+            if (fetch_hot(std::string(keys[i]), buffers[i]) != 0) {
+                hot_miss.push_back(i);
+            }
+        }
+        hot_hits_.fetch_add(keys.size() - hot_miss.size(), std::memory_order_relaxed);
+        hot_misses_.fetch_add(hot_miss.size(), std::memory_order_relaxed);
+        if (hot_miss.empty()) {
+            return keys.size();
+        }
+
+        // keys the disk bloom filter rules out go straight to origin
+        std::vector<size_t> disk_probe;
+        std::vector<std::string_view> disk_keys;
+        std::vector<size_t> disk_miss;
+        std::vector<std::string> origin_keys;
+        for (auto i: hot_miss) {
+            if (disk_cache_->may_contain(keys[i])) {
+                disk_probe.push_back(i);
+                disk_keys.push_back(keys[i]);
+            } else {
+                disk_miss.push_back(i);
+                origin_keys.push_back(std::string(keys[i]));
+            }
+        }
+        disk_skips_.fetch_add(disk_miss.size(), std::memory_order_relaxed);
+        std::vector<BufferHandle> disk_buffers;
+        if (!disk_keys.empty()) {
+            disk_cache_->fetch_many(disk_keys, disk_buffers);
+        }
+        for (size_t j = 0; j < disk_probe.size(); j++) {
+            if (disk_buffers[j] && !servable(std::string(disk_keys[j]), disk_buffers[j])) {
+                erase_dead_disk(std::string(disk_keys[j]));
+                disk_buffers[j] = nullptr;
+            }
+            if (disk_buffers[j]) {
+                buffers[disk_probe[j]] = disk_buffers[j];
+                if (sketch_.estimate(disk_keys[j]) >= kPromoteFreq) {
+                    schedule_promotion(std::string(disk_keys[j]));
+                }
+            } else {
+                disk_miss.push_back(disk_probe[j]);
+                origin_keys.push_back(std::string(disk_keys[j]));
+            }
+        }
+        disk_hits_.fetch_add(hot_miss.size() - disk_miss.size(), std::memory_order_relaxed);
+        disk_misses_.fetch_add(disk_miss.size(), std::memory_order_relaxed);
+
+        size_t hits = keys.size() - disk_miss.size();
+        if (!origin_keys.empty()) {
+            std::vector<BufferHandle> origin_buffers;
+            fetch_many_from_origin(origin_keys, origin_buffers);
+            for (size_t j = 0; j < disk_miss.size(); j++) {
+                buffers[disk_miss[j]] = origin_buffers[j];
+                if (origin_buffers[j]) {
+                    hits++;
+                }
+            }
+        }
+        return hits;
+    }
+
+    // large objects are split off and stored chunked one by one, the rest goes through as one batch
+    size_t store_many_tiered(const std::vector<std::string_view> &keys, const std::vector<BufferHandle> &buffers) {
+        std::vector<std::string_view> object_keys;
+        std::vector<BufferHandle> object_buffers;
+        size_t stored = 0;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (needs_chunking(keys[i], buffers[i])) {
+                stored += (store_chunked(std::string(keys[i]), buffers[i]) == 0);
+            } else {
+                object_keys.push_back(keys[i]);
+                object_buffers.push_back(buffers[i]);
+            }
+        }
+        return stored + store_many_objects(object_keys, object_buffers);
+    }
+
+    // tier keys of the valid client keys, with the index each came from
+    std::vector<std::string> tier_keys(const std::vector<std::string_view> &keys, std::vector<size_t> &from) {
+        std::vector<std::string> tiered;
+        tiered.reserve(keys.size());
+        from.clear();
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (NamespaceGenerations::is_client_key(keys[i])) {
+                tiered.push_back(generations_.tier_key(keys[i]));
+                from.push_back(i);
+            }
+        }
+        return tiered;
+    }
+
+public:
+    // keys with '\x01' or '\0' are rejected (see NamespaceGenerations::is_client_key), here and by
+    // every other public call
+    int store_buffer(std::string_view key_view, BufferHandle buffer) {
+        ScopedLatency latency(store_latency_);
+        if (!NamespaceGenerations::is_client_key(key_view)) {
+            return -1;
+        }
+        std::string key = generations_.tier_key(key_view);
+        if (needs_chunking(key, buffer)) {
+            return store_chunked(key, buffer);
+        }
+        return store_object(key, buffer);
+    }
+
+    // a hot tier hit returns a reference to the cached bytes, waiters on one origin fetch share its buffer
+    // a chunked object comes back reassembled into one buffer
+    int fetch_buffer(std::string_view key_view, BufferHandle & buffer) {
+        ScopedLatency latency(fetch_latency_);
+        if (!NamespaceGenerations::is_client_key(key_view)) {
+            return -1;
+        }
+        observe_fetch(key_view);
+        std::string key = generations_.tier_key(key_view);
+        if (fetch_object(key, buffer, true) != 0) {
+            return -1;
+        }
+        return assemble(key, buffer);
+    }
+
+    // bytes [offset, offset + len) of an object, cut short at its end
+    // - a chunked object only has the chunks overlapping the range fetched
+    // - an object neither tier knows is sized at origin first; a large one gets a manifest and only the
+    //   chunks of the range are pulled from origin, with range requests
+    int fetch_range(std::string client_key, size_t offset, size_t len, std::vector<char> &bytes) {
+        ScopedLatency latency(fetch_latency_);
+        if (!NamespaceGenerations::is_client_key(client_key)) {
+            return -1;
+        }
+        std::string key = generations_.tier_key(client_key);
+        BufferHandle buffer;
+        if (fetch_object(key, buffer, false) != 0 && open_from_origin(key, client_key, buffer) != 0) {
+            return -1;
+        }
+
+        ChunkManifest manifest;
+        if (!parse_manifest(buffer, manifest)) {
+            if (offset > buffer->size()) {
+                return -1;
+            }
+            len = std::min(len, buffer->size() - offset);
+            bytes.assign(buffer->data() + offset, buffer->data() + offset + len);
             return 0;
         }
+        if (offset > manifest.total_size) {
+            return -1;
+        }
+        len = std::min<uint64_t>(len, manifest.total_size - offset);
+        if (len == 0) {
+            bytes.clear();
+            return 0;
+        }
+        return fetch_chunks(key, manifest, offset, len, bytes);
+    }
+
+    // a batch counts as one request per key, each taking the whole batch's time
+    size_t store_many(const std::vector<std::string_view> &keys, const std::vector<BufferHandle> &buffers) {
+        ScopedLatency latency(store_latency_, keys.size());
+        std::vector<size_t> from;
+        std::vector<std::string> tiered = tier_keys(keys, from);
+        std::vector<BufferHandle> valid_buffers;
+        for (size_t i: from) {
+            valid_buffers.push_back(buffers[i]);
+        }
+        return store_many_tiered(std::vector<std::string_view>(tiered.begin(), tiered.end()), valid_buffers);
+    }
+
+    size_t fetch_many(const std::vector<std::string_view> &keys, std::vector<BufferHandle> &buffers) {
+        ScopedLatency latency(fetch_latency_, keys.size());
+        std::vector<size_t> from;
+        std::vector<std::string> tiered = tier_keys(keys, from);
+        std::vector<BufferHandle> found;
+        size_t hits = fetch_many_objects(std::vector<std::string_view>(tiered.begin(), tiered.end()), found);
+        buffers.assign(keys.size(), nullptr);
+        for (size_t j = 0; j < from.size(); j++) {
+            buffers[from[j]] = found[j];
+            if (found[j] && assemble(tiered[j], buffers[from[j]]) != 0) {
+                hits--;
+            }
+        }
+        return hits;
+    }
 
-        return ofetch_service_->fetch(key, bytes);
+    // drops every object cached under namespace ns, in O(1): the namespace moves to a new generation
+    // - tier keys of the old generation are never looked up again; hot copies age out of S3-FIFO
+    //   untouched, the disk tier unlinks them on a background sweep and compaction reclaims the space
+    // returns the namespace's new generation, or 0 if ns is not a valid namespace or the new generation
+    // could not be persisted; nothing is invalidated then
+    uint64_t invalidate_namespace(const std::string &ns) {
+        if (!NamespaceGenerations::is_client_key(ns) || ns.find('/') != std::string::npos) {
+            return 0;
+        }
+        uint64_t generation = generations_.bump(ns);
+        if (generation != 0) {
+            disk_cache_->request_sweep();
+        }
+        return generation;
     }
 
+    // sum of tier occupancy; a promoted object is resident (and counted) in both tiers
     size_t get_size()
     {
-        return 0;
+        return hot_obj_cache_->get_size() + disk_cache_->get_size();
     }
 
     size_t get_capacity()
     {
-        return 0;
+        return hot_obj_cache_->get_capacity() + disk_cache_->get_capacity();
     }
 
+    CacheStats get_stats()
+    {
+        CacheStats stats;
+        stats.hot.hits = hot_hits_.load(std::memory_order_relaxed);
+        stats.hot.misses = hot_misses_.load(std::memory_order_relaxed);
+        stats.hot.size = hot_obj_cache_->get_size();
+        stats.hot.capacity = hot_obj_cache_->get_capacity();
+        stats.disk.hits = disk_hits_.load(std::memory_order_relaxed);
+        stats.disk.misses = disk_misses_.load(std::memory_order_relaxed);
+        stats.disk.size = disk_cache_->get_size();
+        stats.disk_raw_size = disk_cache_->get_raw_size();
+        stats.disk.capacity = disk_cache_->get_capacity();
+        stats.disk_skips = disk_skips_.load(std::memory_order_relaxed);
+        stats.stale_hits = stale_hits_.load(std::memory_order_relaxed);
+        stats.origin_fetches = origin_fetches_.load(std::memory_order_relaxed);
+        stats.prefetches = prefetches_.load(std::memory_order_relaxed);
+        stats.prefetch_drops = prefetch_drops_.load(std::memory_order_relaxed);
+        stats.fetch_latency = fetch_latency_.snapshot();
+        stats.store_latency = store_latency_.snapshot();
+        return stats;
+    }
+};
+
+// benchmark driver
+// usage: facade bench [--target=smart|hot|disk] [--workload=zipf|scan|churn|segments] [--threads=N]
+//                     [--ops=N] [--keys=N] [--theta=F] [--obj-size=BYTES] [--hot-mb=N] [--disk-mb=N]
+//                     [--origin-us=N] [--seed=N] [--compression=none|lz] [--hot-shards=N]
+//                     [--prefetch-mbps=N]
+// workloads:
+// - zipf:  read-through lookups of zipf distributed keys
+// - scan:  zipf lookups, with every 5th op reading the next key of a never ending sequential scan
+// - churn: zipf lookups whose popular set shifts by keys/16 every ops/16 operations, 20% of ops are stores
+// - segments: every thread plays zipf picked objects, reading segments 0 to 15 of each in order
+// a standalone tier runs read-through (store on miss); SmartCache fills itself from the origin
+struct BenchConfig {
+    std::string target = "smart";
+    std::string workload = "zipf";
+    int threads = 4;
+    uint64_t ops = 400000;
+    uint64_t keys = 100000;
+    double theta = 0.99;
+    size_t obj_size = 1024;
+    size_t hot_mb = 16;
+    size_t disk_mb = 64;
+    uint64_t origin_us = 0;
+    uint64_t seed = 42;
+    std::string compression = "none"; // disk tier codec
+    size_t hot_shards = 0;             // 0 = HotObjectCache default
+    size_t prefetch_mbps = 16;         // SmartCache prefetch budget, 0 = no prefetch
+};
+
+// zipf(theta) sampling over [0, n) by binary search in the precomputed cdf
+class ZipfGenerator {
+private:
+    std::vector<double> cdf_;
+public:
+    ZipfGenerator(uint64_t n, double theta): cdf_(n) {
+        double sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            sum += 1.0 / std::pow(static_cast<double>(i + 1), theta);
+            cdf_[i] = sum;
+        }
+        for (auto &c: cdf_) {
+            c /= sum;
+        }
+    }
 
+    uint64_t next(std::mt19937_64 &rng) const {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        return std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+    }
 };
 
-int main()
+static bool parse_bench_args(int argc, char **argv, BenchConfig &config) {
+    for (int i = 0; i < argc; i++) {
+        std::string arg(argv[i]);
+        size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+            std::cerr << "bench: bad argument: " << arg << std::endl;
+            return false;
+        }
+        std::string name = arg.substr(2, eq - 2);
+        std::string value = arg.substr(eq + 1);
+        if (name == "target") {
+            config.target = value;
+        } else if (name == "workload") {
+            config.workload = value;
+        } else if (name == "threads") {
+            config.threads = std::stoi(value);
+        } else if (name == "ops") {
+            config.ops = std::stoull(value);
+        } else if (name == "keys") {
+            config.keys = std::stoull(value);
+        } else if (name == "theta") {
+            config.theta = std::stod(value);
+        } else if (name == "obj-size") {
+            config.obj_size = std::stoull(value);
+        } else if (name == "hot-mb") {
+            config.hot_mb = std::stoull(value);
+        } else if (name == "disk-mb") {
+            config.disk_mb = std::stoull(value);
+        } else if (name == "origin-us") {
+            config.origin_us = std::stoull(value);
+        } else if (name == "seed") {
+            config.seed = std::stoull(value);
+        } else if (name == "hot-shards") {
+            config.hot_shards = std::stoull(value);
+        } else if (name == "compression") {
+            config.compression = value;
+        } else if (name == "prefetch-mbps") {
+            config.prefetch_mbps = std::stoull(value);
+        } else {
+            std::cerr << "bench: unknown option: " << name << std::endl;
+            return false;
+        }
+    }
+    bool known_target = (config.target == "smart" || config.target == "hot" || config.target == "disk");
+    bool known_workload = (config.workload == "zipf" || config.workload == "scan" || config.workload == "churn" ||
+                           config.workload == "segments");
+    bool known_compression = (config.compression == "none" || config.compression == "lz");
+    if (!known_target || !known_workload || !known_compression || config.threads < 1 || config.keys < 1) {
+        std::cerr << "bench: bad target, workload, compression, threads or keys" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int run_benchmark(int argc, char **argv) {
+    BenchConfig config;
+    if (!parse_bench_args(argc, argv, config)) {
+        return 1;
+    }
+
+    std::unique_ptr<ICache> cache;
+    SmartCache *smart_cache = nullptr;
+    CompressionType compression = (config.compression == "lz") ? LZ : NO_COMPRESSION;
+    if (config.target == "smart") {
+        auto origin = new OriginFetchService(config.obj_size, std::chrono::microseconds(config.origin_us), false);
+        std::filesystem::remove_all("smartcache_bench_disk"); // every run starts cold
+        smart_cache = new SmartCache(config.hot_mb << 20, config.disk_mb << 20, origin, "smartcache_bench_disk");
+        smart_cache->set_disk_compression(compression);
+        smart_cache->set_prefetch_budget(config.prefetch_mbps << 20, std::max<size_t>(config.prefetch_mbps << 16, 1));
+        cache.reset(smart_cache);
+    } else if (config.target == "hot") {
+        cache.reset(new HotObjectCache(config.hot_mb << 20, config.hot_shards));
+    } else {
+        std::filesystem::remove_all("smartcache_bench_disk"); // every run starts cold
+        DiskCache *disk_cache = new DiskCache(config.disk_mb << 20, "smartcache_bench_disk");
+        disk_cache->set_compression(compression);
+        cache.reset(disk_cache);
+    }
+
+    ZipfGenerator zipf(config.keys, config.theta);
+    BufferHandle payload = make_buffer(std::vector<char>(config.obj_size, 'b'));
+    LatencyHistogram latency;
+    std::atomic<uint64_t> next_op(0);
+    std::atomic<uint64_t> scan_cursor(0);
+    std::atomic<uint64_t> hits(0);
+    std::atomic<uint64_t> lookups(0);
+    const uint64_t batch = 256; // ops claimed by a thread at a time
+
+    auto worker = [&](int id) {
+        std::mt19937_64 rng(config.seed + id);
+        BufferHandle buffer;
+        uint64_t local_hits = 0;
+        uint64_t local_lookups = 0;
+        uint64_t segment = 16;
+        uint64_t playing = 0;
+        for (uint64_t begin = next_op.fetch_add(batch); begin < config.ops; begin = next_op.fetch_add(batch)) {
+            uint64_t end = std::min(begin + batch, config.ops);
+            for (uint64_t op = begin; op < end; op++) {
+                uint64_t key_id = zipf.next(rng);
+                bool is_store = false;
+                if (config.workload == "scan" && op % 5 == 0) {
+                    key_id = config.keys + scan_cursor.fetch_add(1, std::memory_order_relaxed);
+                } else if (config.workload == "churn") {
+                    key_id = (key_id + (op / std::max<uint64_t>(config.ops / 16, 1)) * (config.keys / 16)) % config.keys;
+                    is_store = (rng() % 5 == 0);
+                }
+                std::string key = "obj-" + std::to_string(key_id);
+                if (config.workload == "segments") {
+                    if (segment == 16) {
+                        playing = key_id;
+                        segment = 0;
+                    }
+                    key = "obj-" + std::to_string(playing) + "/seg-" + std::to_string(segment++);
+                }
+
+                auto start = std::chrono::steady_clock::now();
+                if (is_store) {
+                    cache->store_buffer(key, payload);
+                } else {
+                    local_lookups++;
+                    if (cache->fetch_buffer(key, buffer) == 0) {
+                        local_hits++;
+                    } else if (!smart_cache) {
+                        cache->store_buffer(key, payload); // read-through fill
+                    }
+                }
+                auto elapsed = std::chrono::steady_clock::now() - start;
+                latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+            }
+        }
+        hits.fetch_add(local_hits);
+        lookups.fetch_add(local_lookups);
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < config.threads; i++) {
+        threads.emplace_back(worker, i);
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    LatencyHistogram::Snapshot snap = latency.snapshot();
+    std::cout << "bench: target = " << config.target << ", workload = " << config.workload
+        << ", threads = " << config.threads << ", ops = " << config.ops << ", keys = " << config.keys
+        << ", obj size = " << config.obj_size << std::endl;
+    std::cout << " throughput = " << static_cast<uint64_t>(config.ops / seconds) << " ops/s" << std::endl;
+    if (smart_cache) {
+        CacheStats stats = smart_cache->get_stats();
+        auto ratio = [](uint64_t hit, uint64_t miss) { return (hit + miss) ? 100.0 * hit / (hit + miss) : 0.0; };
+        std::cout << " hot hit ratio = " << ratio(stats.hot.hits, stats.hot.misses) << "%"
+            << ", disk hit ratio = " << ratio(stats.disk.hits, stats.disk.misses) << "%"
+            << " (of hot misses), origin fetches = " << stats.origin_fetches << std::endl;
+        std::cout << " disk size = " << stats.disk.size << ", uncompressed = " << stats.disk_raw_size << std::endl;
+        std::cout << " prefetches = " << stats.prefetches << ", dropped for budget = " << stats.prefetch_drops << std::endl;
+    } else {
+        std::cout << " " << config.target << " hit ratio = "
+            << (lookups ? 100.0 * hits / lookups : 0.0) << "%" << std::endl;
+    }
+    std::cout << " latency: mean = " << snap.mean() << "ns, p50 = " << snap.percentile(0.5)
+        << "ns, p99 = " << snap.percentile(0.99) << "ns, p999 = " << snap.percentile(0.999) << "ns" << std::endl;
+    return 0;
+}
+
+int main(int argc, char **argv)
 {
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        return run_benchmark(argc - 2, argv + 2);
+    }
+
     std::vector<char> send_bytes(1024, 1);
     std::vector<char> recv_bytes(1024, 1);
-    SmartCache smart_cache(128, 1024);
+    // every run starts cold, in a temp directory rather than the working tree
+    std::string demo_dir = (std::filesystem::temp_directory_path() / "smartcache_demo").string();
+    std::filesystem::remove_all(demo_dir);
+    SmartCache smart_cache(256 * 1024, 64 * 1024, nullptr, demo_dir);
     smart_cache.store("sample", send_bytes);
     smart_cache.fetch("sample", recv_bytes);
 
+    // concurrent misses on one key are collapsed into a single origin fetch
+    std::vector<std::thread> clients;
+    for (int i = 0; i < 8; i++) {
+        clients.emplace_back([&smart_cache]() {
+            std::vector<char> bytes;
+            smart_cache.fetch("popular", bytes);
+        });
+    }
+    for (auto &client: clients) {
+        client.join();
+    }
+
+    // buffer handles: a hot tier hit is a reference to the cached bytes, not a copy
+    smart_cache.store_buffer("shared", make_buffer(send_bytes));
+    BufferHandle hit1, hit2;
+    smart_cache.fetch_buffer("shared", hit1);
+    smart_cache.fetch_buffer("shared", hit2);
+    std::cout << "SmartCache: two hits share one copy of the bytes: " << (hit1->data() == hit2->data()) << std::endl;
+
+    // stale-while-revalidate: past its ttl, "news" is served stale while origin refreshes it
+    smart_cache.store_buffer("news", make_buffer(send_bytes, Freshness::ttl(std::chrono::milliseconds(20),
+                                                                             std::chrono::seconds(5))));
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    BufferHandle news;
+    smart_cache.fetch_buffer("news", news);
+    std::cout << "SmartCache: news served stale: " << (news->freshness().state(now_ms()) == Freshness::STALE) << std::endl;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    smart_cache.fetch_buffer("news", news);
+    std::cout << "SmartCache: news refreshed: " << (news->freshness().state(now_ms()) == Freshness::FRESH) << std::endl;
+
+    // batched lookups: hot hits, one disk batch and one origin request for the rest
+    std::vector<std::string_view> page_keys = {"shared", "popular", "page-1", "page-2", "page-3"};
+    std::vector<BufferHandle> page_objs;
+    size_t page_hits = smart_cache.fetch_many(page_keys, page_objs);
+    std::cout << "SmartCache: fetched " << page_hits << " of " << page_keys.size() << " page objs" << std::endl;
+
+    // namespace purge: one generation bump hides every "customer-a/" object, other namespaces keep theirs
+    smart_cache.store("customer-a/logo.png", send_bytes);
+    smart_cache.store("customer-b/logo.png", send_bytes);
+    uint64_t generation = smart_cache.invalidate_namespace("customer-a");
+    std::vector<char> logo;
+    smart_cache.fetch("customer-a/logo.png", logo); // back to origin
+    std::cout << "SmartCache: customer-a now at generation " << generation
+        << ", logo refetched from origin: " << (logo != send_bytes) << std::endl;
+    // a client key may not carry the separators tier and chunk keys are built with
+    std::string forged("customer-a/logo.png\x01" "1", 21);
+    std::cout << "SmartCache: key with a generation tag rejected: " << (smart_cache.store(forged, send_bytes) != 0)
+        << std::endl;
+
+    // predictive prefetch: two steps of a sequence are enough for the next segments to be loaded ahead
+    std::vector<char> segment;
+    smart_cache.fetch("movie/seg-1", segment);
+    smart_cache.fetch("movie/seg-2", segment);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    uint64_t hot_hits = smart_cache.get_stats().hot.hits;
+    smart_cache.fetch("movie/seg-3", segment);
+    std::cout << "SmartCache: prefetched seg-3 was a hot hit: " << (smart_cache.get_stats().hot.hits == hot_hits + 1) << std::endl;
+
+    CacheStats stats = smart_cache.get_stats();
+    std::cout << "SmartCache: size = " << smart_cache.get_size() << " of " << smart_cache.get_capacity() << std::endl
+        << " hot:  hits = " << stats.hot.hits << ", misses = " << stats.hot.misses
+        << ", size = " << stats.hot.size << " of " << stats.hot.capacity << std::endl
+        << " disk: hits = " << stats.disk.hits << ", misses = " << stats.disk.misses
+        << ", size = " << stats.disk.size << " of " << stats.disk.capacity << std::endl
+        << " disk lookups skipped by bloom filter = " << stats.disk_skips << std::endl
+        << " stale hits = " << stats.stale_hits << std::endl
+        << " origin fetches = " << stats.origin_fetches << std::endl
+        << " prefetches = " << stats.prefetches << std::endl
+        << " fetch latency: p50 = " << stats.fetch_latency.percentile(0.5) << "ns"
+        << ", p99 = " << stats.fetch_latency.percentile(0.99) << "ns" << std::endl;
+
+    // range requests on a 1MB object in 64KB chunks: only the chunks a range overlaps are fetched and cached
+    {
+        std::filesystem::remove_all("smartcache_range_demo");
+        SmartCache range_cache(256 * 1024, 4 * 1024 * 1024, new OriginFetchService(1 << 20), "smartcache_range_demo");
+        range_cache.set_chunk_size(64 * 1024);
+        std::vector<char> range;
+        range_cache.fetch_range("video", 100000, 100000, range); // chunks 1 to 3, one range request
+        range_cache.fetch_range("video", 150000, 1000, range);   // served from the cached chunk 2
+        std::vector<char> expected;
+        for (size_t pos = 150000; pos < 151000; pos++) {
+            expected.push_back(static_cast<char>('a' + pos % 26));
+        }
+        std::cout << "SmartCache: range fetch ok: " << (range == expected)
+            << ", origin fetches = " << range_cache.get_stats().origin_fetches
+            << ", cached bytes = " << range_cache.get_size() << std::endl;
+
+        std::vector<char> big(300 * 1000, 'v');
+        range_cache.store("upload", big);
+        range_cache.fetch("upload", recv_bytes);
+        std::cout << "SmartCache: chunked upload round trip ok: " << (recv_bytes == big) << std::endl;
+    }
+
+    // hot tier keeps accepting writes once full: cold objects are evicted to make room
+    HotObjectCache hot_cache(64 * 1024);
+    std::vector<char> obj(1000, 1);
+    hot_cache.store("hot", obj);
+    for (int i = 0; i < 256; i++) {
+        hot_cache.fetch("hot", recv_bytes); // keeps "hot" in the working set
+        hot_cache.store("scan-" + std::to_string(i), obj);
+    }
+    std::cout << "HotObjCache: size = " << hot_cache.get_size() << " of " << hot_cache.get_capacity()
+        << ", hot obj cached: " << (hot_cache.fetch("hot", recv_bytes) == 0) << std::endl;
+
+    // disk tier appends to 4KB segments; overwrites leave dead records for the compactor
+    std::filesystem::remove_all("smartcache_disk_demo");
+    {
+        DiskCache disk_cache(16 * 1024, "smartcache_disk_demo", 4096);
+        for (int i = 0; i < 64; i++) {
+            disk_cache.store("obj-" + std::to_string(i % 8), obj);
+        }
+        disk_cache.erase("obj-5");
+        std::cout << "DiskCache: size = " << disk_cache.get_size() << " of " << disk_cache.get_capacity()
+            << ", obj-3 cached: " << (disk_cache.fetch("obj-3", recv_bytes) == 0)
+            << " (" << recv_bytes.size() << " bytes)" << std::endl;
+    }
+    // warm restart: the index comes back from the snapshot left by the previous instance
+    DiskCache restarted_disk_cache(16 * 1024, "smartcache_disk_demo", 4096);
+    std::cout << "DiskCache: after restart size = " << restarted_disk_cache.get_size()
+        << ", obj-3 cached: " << (restarted_disk_cache.fetch("obj-3", recv_bytes) == 0)
+        << ", obj-5 cached: " << (restarted_disk_cache.fetch("obj-5", recv_bytes) == 0) << std::endl;
+
+    // compressed disk tier: text like objects take a fraction of the capacity, fetch inflates them
+    std::filesystem::remove_all("smartcache_disk_lz_demo");
+    DiskCache lz_disk_cache(64 * 1024, "smartcache_disk_lz_demo", 16 * 1024);
+    lz_disk_cache.set_compression(LZ);
+    std::string page;
+    for (int i = 0; page.size() < 4000; i++) {
+        page += "<li class=\"item\"><a href=\"/catalog/item/" + std::to_string(i) + "\">item " + std::to_string(i) + "</a></li>\n";
+    }
+    for (int i = 0; i < 8; i++) {
+        lz_disk_cache.store("page-" + std::to_string(i), std::vector<char>(page.begin(), page.end()));
+    }
+    lz_disk_cache.fetch("page-3", recv_bytes);
+    std::cout << "DiskCache (lz): size = " << lz_disk_cache.get_size() << ", uncompressed = " << lz_disk_cache.get_raw_size()
+        << ", page-3 intact: " << (std::string(recv_bytes.begin(), recv_bytes.end()) == page) << std::endl;
+
     return 0;
 }
\ No newline at end of file
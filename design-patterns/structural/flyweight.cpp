@@ -10,76 +10,993 @@
 // Client uses it in read-only mode, unless the hashmap deletes the returned obj.
 // for most part, flyweight is useful when objects cached are read-only
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <thread>
 #include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-class Keyword {
+// a keyword handle. id is a dense 32-bit slot in the keyword table and is the flyweight
+// callers pass around; generation tells the keyword that owns the slot apart from one
+// that was evicted from it earlier, so a stale handle is detected instead of resolving
+// to some other keyword.
+struct Keyword {
+    uint32_t id;
+    uint32_t generation;
+
+    bool operator==(const Keyword &other) const {
+        return id == other.id && generation == other.generation;
+    }
+};
+static constexpr uint32_t kInvalidKeyword = UINT32_MAX;
+
+// epoch based reclamation for the lock-free readers of the keyword table.
+// a reader pins the current epoch for the duration of one lookup by bumping a counter in
+// its own stripe, so readers on different threads do not bounce a shared cache line.
+// the writer retires memory it has already unlinked; reclaim() flips the epoch, waits for
+// the readers still pinned in the old one to drain and then frees everything retired.
+class EpochDomain {
 private:
-    std::string key_;
-    int64_t last_accessed_time_;
+    static constexpr size_t kStripes = 64;
+
+    struct alignas(64) Counter {
+        std::atomic<int64_t> value{0};
+    };
+
+    std::atomic<uint64_t> epoch_{0};
+    Counter pinned_[2][kStripes];
+    std::vector<std::function<void()>> retired_;
+
+    static size_t stripe() {
+        static std::atomic<size_t> next{0};
+        thread_local size_t mine = next.fetch_add(1, std::memory_order_relaxed) % kStripes;
+        return mine;
+    }
+
 public:
-    Keyword(std::string key): key_(key) {}
-    void set_access_time(int64_t timestamp) {
-        last_accessed_time_ = timestamp;
+    class Guard {
+    private:
+        std::atomic<int64_t> *counter_;
+    public:
+        explicit Guard(EpochDomain &domain) {
+            size_t s = stripe();
+            for (;;) {
+                uint64_t epoch = domain.epoch_.load(std::memory_order_seq_cst);
+                counter_ = &domain.pinned_[epoch & 1][s].value;
+                counter_->fetch_add(1, std::memory_order_seq_cst);
+                // lost a race with reclaim(): pin the new epoch instead
+                if (domain.epoch_.load(std::memory_order_seq_cst) == epoch) {
+                    break;
+                }
+                counter_->fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+        ~Guard() {
+            counter_->fetch_sub(1, std::memory_order_release);
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    EpochDomain() = default;
+    EpochDomain(const EpochDomain&) = delete;
+    EpochDomain& operator=(const EpochDomain&) = delete;
+
+    ~EpochDomain() {
+        for (auto &deleter: retired_) {
+            deleter();
+        }
     }
-    int64_t get_last_accessed_time() {
-        return last_accessed_time_;
+
+    // retire() and reclaim() are serialized by the owner; reclaim() must not be called while pinned
+    void retire(std::function<void()> deleter) {
+        retired_.push_back(std::move(deleter));
     }
-};
 
-class KeyWordFactory {
-public:
-    Keyword* get_keyword(std::string key) {
-        auto keyword = new Keyword(key);
-        keyword->set_access_time(232354);
-        return keyword;
+    void reclaim() {
+        if (retired_.empty()) {
+            return;
+        }
+        uint64_t epoch = epoch_.fetch_add(1, std::memory_order_seq_cst);
+        for (size_t s = 0; s < kStripes; s++) {
+            while (pinned_[epoch & 1][s].value.load(std::memory_order_seq_cst) != 0) {
+                std::this_thread::yield();
+            }
+        }
+        for (auto &deleter: retired_) {
+            deleter();
+        }
+        retired_.clear();
     }
 };
 
-// rather than creating the keyword strings/objs again and again, we store one obj per specific keyword
+// rather than creating the keyword strings/objs again and again, we store one copy per specific keyword
 // when a particular keyword repeats in a million searches, the mem savings will be massive
 // as we create only one instance of the string
-
+//
+// the table is built for many concurrent readers and comparatively rare inserts:
+//  - keyword text lives in an arena of large chunks behind a small header holding its
+//    length, so a keyword is a single pointer and readers never see a torn (data, len) pair.
+//  - id -> text is a segmented directory. segment s holds kBaseSegment << s entries,
+//    so the directory grows without ever relocating an entry.
+//  - text -> id is an open-addressing table of 64-bit slots packing (hash tag, id + 1).
+//    readers probe it with plain atomic loads, no lock.
+//  - inserts, evictions and table rebuilds take a single mutex. memory they unlink is
+//    handed to the epoch domain and freed once no reader can still be looking at it.
+//
+// with a memory limit, a CLOCK sweep keeps the table under it. every hit sets a keyword's
+// referenced bit (only if clear, so hot keywords do not turn reads into shared writes);
+// the hand clears set bits and evicts keywords whose bit is still clear on the next pass.
+// pinned keywords are skipped, so a table full of them may stay above its limit.
+// eviction leaves holes in the arena chunks, so the sweep then copies the survivors of
+// sparse chunks into the youngest chunk and frees the old chunk whole.
 class FlyWeight {
 private:
-    KeyWordFactory *factory_;
-    std::unordered_map<std::string, Keyword*> index_;
-    std::unordered_map<Keyword*, std::string> rev_index_;
+    struct Entry {
+        std::atomic<const char*> text{nullptr};
+        std::atomic<uint32_t> generation{0};
+        mutable std::atomic<uint8_t> referenced{0};
+        bool pinned = false;    // writer only
+    };
+
+    // arena record header; the text follows it
+    struct Record {
+        uint32_t len;
+        uint32_t chunk;    // writer only
+    };
+
+    struct Chunk {
+        char *data;
+        size_t size;
+        size_t used;
+        size_t live;
+    };
+
+    struct Table {
+        size_t mask;
+        std::unique_ptr<std::atomic<uint64_t>[]> slots;
+
+        explicit Table(size_t capacity):
+            mask(capacity - 1), slots(new std::atomic<uint64_t>[capacity]) {
+            for (size_t i = 0; i < capacity; i++) {
+                slots[i].store(0, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    static constexpr size_t kBaseSegment = 1024;
+    static constexpr size_t kSegments = 23;    // enough for 2^32 ids
+    static constexpr size_t kChunkSize = 64 * 1024;
+    static constexpr size_t kInitialCapacity = 2048;
+    static constexpr uint32_t kMaxIds = UINT32_MAX - 1;    // id + 1 == UINT32_MAX is the tombstone
+    static constexpr uint32_t kNoChunk = UINT32_MAX;
+    static constexpr uint64_t kTombstone = UINT64_MAX;
+
+    mutable EpochDomain epochs_; // const readers pin an epoch too
+    std::atomic<Table*> table_;
+    std::atomic<Entry*> segments_[kSegments];
+    std::atomic<uint32_t> high_water_{0};    // every id below has a directory entry
+    std::atomic<size_t> live_{0};
+
+    // everything below is only touched with write_mutex_ held
+    std::mutex write_mutex_;
+    std::vector<uint32_t> free_ids_;
+    std::vector<Chunk> chunks_;
+    std::vector<uint32_t> free_chunks_;
+    uint32_t current_ = kNoChunk;
+    size_t table_used_ = 0;    // live slots plus tombstones
+    size_t directory_bytes_ = 0;
+    size_t chunk_bytes_ = 0;
+    size_t live_text_ = 0;
+    size_t memory_limit_;
+    size_t swept_usage_ = 0;    // usage right after the last sweep
+    uint32_t hand_ = 0;
+    size_t evictions_ = 0;
+
+    static uint64_t hash_of(std::string_view key) {
+        return std::hash<std::string_view>()(key);
+    }
+
+    static uint64_t make_slot(uint64_t hash, uint32_t id) {
+        return (hash & 0xffffffff00000000ull) | (uint64_t(id) + 1);
+    }
+
+    static Record header(const char *text) {
+        Record record;
+        std::memcpy(&record, text, sizeof(record));
+        return record;
+    }
+
+    static std::string_view view(const char *text) {
+        return std::string_view(text + sizeof(Record), header(text).len);
+    }
+
+    static size_t record_size(std::string_view key) {
+        return sizeof(Record) + key.size();
+    }
+
+    // the hash table is rebuilt at a quarter load and grows at half
+    static size_t capacity_for(size_t live) {
+        size_t capacity = kInitialCapacity;
+        while (capacity < (live + 1) * 4) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    size_t table_bytes() const {
+        return (table_.load(std::memory_order_relaxed)->mask + 1) * sizeof(uint64_t);
+    }
+
+    static void locate(uint32_t id, size_t &segment, size_t &offset) {
+        size_t x = id / kBaseSegment + 1;
+        segment = 63 - __builtin_clzll(x);
+        offset = id - kBaseSegment * ((size_t(1) << segment) - 1);
+    }
+
+    Entry& entry(uint32_t id) const {
+        size_t segment, offset;
+        locate(id, segment, offset);
+        return segments_[segment].load(std::memory_order_acquire)[offset];
+    }
+
+    // callers are pinned or hold write_mutex_
+    int lookup(const Table *table, std::string_view key, uint64_t hash, Keyword &keyword) const {
+        for (size_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+            uint64_t slot = table->slots[i].load(std::memory_order_acquire);
+            if (slot == 0) {
+                return -1;
+            }
+            if (slot == kTombstone || (slot ^ hash) >> 32 != 0) {
+                continue;
+            }
+            uint32_t id = uint32_t(slot) - 1;
+            const Entry &e = entry(id);
+            uint32_t generation = e.generation.load(std::memory_order_acquire);
+            const char *text = e.text.load(std::memory_order_acquire);
+            if (text == nullptr || view(text) != key) {
+                continue;
+            }
+            // evicted (and maybe reused) while we compared
+            if (e.generation.load(std::memory_order_acquire) != generation) {
+                continue;
+            }
+            if (e.referenced.load(std::memory_order_relaxed) == 0) {
+                e.referenced.store(1, std::memory_order_relaxed);
+            }
+            keyword = Keyword{id, generation};
+            return 0;
+        }
+    }
+
+    void insert(Table *table, uint64_t hash, uint32_t id) {
+        size_t i = hash & table->mask;
+        for (;; i = (i + 1) & table->mask) {
+            uint64_t slot = table->slots[i].load(std::memory_order_relaxed);
+            if (slot == 0) {
+                table_used_++;
+                break;
+            }
+            if (slot == kTombstone) {
+                break;
+            }
+        }
+        table->slots[i].store(make_slot(hash, id), std::memory_order_release);
+    }
+
+    // copies the live keywords into a fresh table sized for them, dropping tombstones
+    Table* rebuild() {
+        size_t capacity = capacity_for(live_.load(std::memory_order_relaxed));
+        Table *old = table_.load(std::memory_order_relaxed);
+        Table *table = new Table(capacity);
+        table_used_ = 0;
+        uint32_t high = high_water_.load(std::memory_order_relaxed);
+        for (uint32_t id = 0; id < high; id++) {
+            const char *text = entry(id).text.load(std::memory_order_relaxed);
+            if (text != nullptr) {
+                insert(table, hash_of(view(text)), id);
+            }
+        }
+        table_.store(table, std::memory_order_release);
+        epochs_.retire([old]() { delete old; });
+        epochs_.reclaim();
+        return table;
+    }
+
+    uint32_t new_chunk(size_t size) {
+        uint32_t index;
+        if (!free_chunks_.empty()) {
+            index = free_chunks_.back();
+            free_chunks_.pop_back();
+        } else {
+            index = uint32_t(chunks_.size());
+            chunks_.emplace_back();
+        }
+        chunks_[index] = Chunk{new char[size], size, 0, 0};
+        chunk_bytes_ += size;
+        return index;
+    }
+
+    void retire_chunk(uint32_t index) {
+        char *data = chunks_[index].data;
+        chunk_bytes_ -= chunks_[index].size;
+        chunks_[index] = Chunk{nullptr, 0, 0, 0};
+        free_chunks_.push_back(index);
+        epochs_.retire([data]() { delete[] data; });
+    }
+
+    const char* store_text(std::string_view key) {
+        size_t bytes = record_size(key);
+        uint32_t chunk;
+        if (bytes > kChunkSize / 4) {
+            chunk = new_chunk(bytes);
+        } else {
+            if (current_ == kNoChunk || chunks_[current_].size - chunks_[current_].used < bytes) {
+                uint32_t previous = current_;
+                current_ = new_chunk(kChunkSize);
+                if (previous != kNoChunk && chunks_[previous].live == 0) {
+                    retire_chunk(previous);
+                }
+            }
+            chunk = current_;
+        }
+        Chunk &c = chunks_[chunk];
+        char *text = c.data + c.used;
+        Record record = {uint32_t(key.size()), chunk};
+        std::memcpy(text, &record, sizeof(record));
+        std::memcpy(text + sizeof(record), key.data(), key.size());
+        c.used += bytes;
+        c.live += bytes;
+        live_text_ += bytes;
+        return text;
+    }
+
+    void release_text(const char *text) {
+        uint32_t chunk = header(text).chunk;
+        size_t bytes = sizeof(Record) + header(text).len;
+        chunks_[chunk].live -= bytes;
+        live_text_ -= bytes;
+        if (chunks_[chunk].live == 0 && chunk != current_) {
+            retire_chunk(chunk);
+        }
+    }
+
+    void evict(uint32_t id) {
+        Entry &e = entry(id);
+        const char *text = e.text.load(std::memory_order_relaxed);
+        std::string_view key = view(text);
+        // unlink from the hash table first so no new reader can reach it
+        Table *table = table_.load(std::memory_order_relaxed);
+        for (size_t i = hash_of(key) & table->mask;; i = (i + 1) & table->mask) {
+            uint64_t slot = table->slots[i].load(std::memory_order_relaxed);
+            if (slot != kTombstone && uint32_t(slot) == id + 1) {
+                table->slots[i].store(kTombstone, std::memory_order_release);
+                break;
+            }
+        }
+        e.text.store(nullptr, std::memory_order_release);
+        e.generation.fetch_add(1, std::memory_order_release);
+        e.pinned = false;
+        release_text(text);
+        free_ids_.push_back(id);
+        live_.fetch_sub(1, std::memory_order_relaxed);
+        evictions_++;
+    }
+
+    // what the table would hold once the hash table is resized and every chunk compacted
+    size_t projected_bytes() const {
+        return directory_bytes_ + capacity_for(live_.load(std::memory_order_relaxed)) * sizeof(uint64_t)
+            + live_text_ / 3 * 4 + kChunkSize;
+    }
+
+    // generational step of the sweep: chunks that lost more than a quarter of their bytes
+    // have their survivors copied into the youngest chunk and are freed once empty
+    void compact() {
+        uint32_t high = high_water_.load(std::memory_order_relaxed);
+        for (uint32_t id = 0; id < high; id++) {
+            Entry &e = entry(id);
+            const char *text = e.text.load(std::memory_order_relaxed);
+            if (text == nullptr || header(text).chunk == current_) {
+                continue;
+            }
+            const Chunk &c = chunks_[header(text).chunk];
+            if (c.live * 4 >= c.used * 3) {
+                continue;
+            }
+            e.text.store(store_text(view(text)), std::memory_order_release);
+            release_text(text);
+        }
+    }
+
+    // CLOCK sweep down to three quarters of the limit, leaving headroom so a table at its
+    // limit does not sweep on every insert. when the directory alone is over the limit no
+    // amount of eviction helps, so the next sweep waits for usage to grow past this one.
+    void sweep() {
+        size_t target = memory_limit_ / 4 * 3;
+        uint32_t high = high_water_.load(std::memory_order_relaxed);
+        hand_ %= high;
+        for (size_t step = 0; step < 2 * size_t(high) && projected_bytes() > target; step++) {
+            Entry &e = entry(hand_);
+            if (e.text.load(std::memory_order_relaxed) != nullptr && !e.pinned) {
+                if (e.referenced.load(std::memory_order_relaxed) != 0) {
+                    e.referenced.store(0, std::memory_order_relaxed);
+                } else {
+                    evict(hand_);
+                }
+            }
+            hand_ = hand_ + 1 == high ? 0 : hand_ + 1;
+        }
+        if (table_bytes() > capacity_for(live_.load(std::memory_order_relaxed)) * sizeof(uint64_t)) {
+            rebuild();
+        }
+        compact();
+        epochs_.reclaim();
+        swept_usage_ = directory_bytes_ + table_bytes() + chunk_bytes_;
+    }
+
 public:
-    FlyWeight() {
-        factory_ = new KeyWordFactory();
+    // memory_limit of 0 leaves the table unbounded
+    explicit FlyWeight(size_t memory_limit = 0): memory_limit_(memory_limit) {
+        table_.store(new Table(kInitialCapacity), std::memory_order_relaxed);
+        for (auto &segment: segments_) {
+            segment.store(nullptr, std::memory_order_relaxed);
+        }
     }
 
-    Keyword* get_keyword(std::string key) {
-        if (index_.find(key) != index_.end()) {
-            index_[key]->set_access_time(232343);    
+    ~FlyWeight() {
+        delete table_.load(std::memory_order_relaxed);
+        for (auto &segment: segments_) {
+            delete[] segment.load(std::memory_order_relaxed);
+        }
+        for (auto &chunk: chunks_) {
+            delete[] chunk.data;
+        }
+    }
+
+    FlyWeight(const FlyWeight&) = delete;
+    FlyWeight& operator=(const FlyWeight&) = delete;
+
+    // interns key and returns its handle. lock-free when the keyword is already known.
+    // returns an id of kInvalidKeyword once the id space is exhausted.
+    Keyword get_keyword(std::string_view key) {
+        uint64_t hash = hash_of(key);
+        Keyword keyword;
+        {
+            EpochDomain::Guard guard(epochs_);
+            if (lookup(table_.load(std::memory_order_acquire), key, hash, keyword) == 0) {
+                return keyword;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        // another writer may have added it, possibly into a table we did not see
+        if (lookup(table_.load(std::memory_order_relaxed), key, hash, keyword) == 0) {
+            return keyword;
+        }
+        uint32_t high = high_water_.load(std::memory_order_relaxed);
+        if ((free_ids_.empty() && high == kMaxIds) || key.size() > UINT32_MAX - sizeof(Record)) {
+            return Keyword{kInvalidKeyword, 0};
+        }
+
+        Table *table = table_.load(std::memory_order_relaxed);
+        if ((table_used_ + 1) * 2 > table->mask + 1) {
+            table = rebuild();
+        }
+
+        uint32_t id;
+        if (!free_ids_.empty()) {
+            id = free_ids_.back();
+            free_ids_.pop_back();
         } else {
-            index_[key] = new Keyword(key);
-            rev_index_[index_[key]] = key;
+            id = high;
+            size_t segment, offset;
+            locate(id, segment, offset);
+            if (segments_[segment].load(std::memory_order_relaxed) == nullptr) {
+                segments_[segment].store(new Entry[kBaseSegment << segment], std::memory_order_release);
+                directory_bytes_ += (kBaseSegment << segment) * sizeof(Entry);
+            }
+        }
+        Entry &e = entry(id);
+        const char *text = store_text(key);
+        e.referenced.store(1, std::memory_order_relaxed);
+        e.text.store(text, std::memory_order_release);
+        if (id == high) {
+            high_water_.store(high + 1, std::memory_order_release);
         }
-        return index_[key];
+        live_.fetch_add(1, std::memory_order_relaxed);
+        insert(table, hash, id);
+        keyword = Keyword{id, e.generation.load(std::memory_order_relaxed)};
+
+        size_t usage = directory_bytes_ + table_bytes() + chunk_bytes_;
+        if (memory_limit_ != 0 && usage > memory_limit_ && usage > swept_usage_) {
+            sweep();
+        }
+        return keyword;
+    }
+
+    // lookup without interning
+    int find(std::string_view key, Keyword &keyword) const {
+        EpochDomain::Guard guard(epochs_);
+        return lookup(table_.load(std::memory_order_acquire), key, hash_of(key), keyword);
     }
 
-    int get_key(Keyword* keyword, std::string &key) {
-        if (rev_index_.find(keyword) != rev_index_.end()) {
-            key = rev_index_[keyword];
+    // O(1) handle -> text. returns -1 if the keyword was evicted since the handle was taken.
+    int get_key(Keyword keyword, std::string &key) const {
+        if (keyword.id >= high_water_.load(std::memory_order_acquire)) {
+            return -1;
+        }
+        EpochDomain::Guard guard(epochs_);
+        const Entry &e = entry(keyword.id);
+        if (e.generation.load(std::memory_order_acquire) != keyword.generation) {
+            return -1;
+        }
+        const char *text = e.text.load(std::memory_order_acquire);
+        if (text == nullptr) {
+            return -1;
+        }
+        std::string_view view_of_key = view(text);
+        if (e.generation.load(std::memory_order_acquire) != keyword.generation) {
+            return -1;
+        }
+        key.assign(view_of_key.data(), view_of_key.size());
+        return 0;
+    }
+
+    // keeps the keyword out of the sweep for good, e.g. while an index holds postings for it.
+    // returns -1 if the keyword was evicted since the handle was taken.
+    int pin(Keyword keyword) {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        if (keyword.id >= high_water_.load(std::memory_order_relaxed)) {
+            return -1;
+        }
+        Entry &e = entry(keyword.id);
+        if (e.text.load(std::memory_order_relaxed) == nullptr
+            || e.generation.load(std::memory_order_relaxed) != keyword.generation) {
+            return -1;
+        }
+        e.pinned = true;
+        return 0;
+    }
+
+    size_t size() const {
+        return live_.load(std::memory_order_relaxed);
+    }
+
+    size_t evictions() {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        return evictions_;
+    }
+
+    // bytes held by the arena chunks, the directory and the hash table
+    size_t memory_usage() {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        return directory_bytes_ + table_bytes() + chunk_bytes_;
+    }
+};
+
+// sorted list of the document ids a keyword occurs in, compressed in blocks of kBlockSize
+// - a block stores its first id in the skip table and the gaps to the rest bit-packed at the
+//   width of its largest gap, so dense lists of common keywords shrink to a few bits per id
+// - the skip table also keeps each block's last id, so a seek decodes only the block it lands in
+// - the open block at the tail stays uncompressed until it fills up
+class PostingList {
+public:
+    static constexpr size_t kBlockSize = 128;
+
+    // walks the list in order; seek() is the galloping step of an intersection
+    class Cursor {
+    public:
+        explicit Cursor(const PostingList &list): list_(list), block_(0), pos_(0), count_(0) {
+            if (list_.blocks() != 0) {
+                count_ = list_.decode(0, docs_);
+            }
+        }
+
+        bool valid() const {
+            return pos_ < count_;
+        }
+
+        uint32_t doc() const {
+            return docs_[pos_];
+        }
+
+        void next() {
+            if (++pos_ == count_) {
+                load(block_ + 1);
+            }
+        }
+
+        // moves to the first doc >= target. gallops over the skip table to the block holding
+        // it, then gallops over groups of 8 ids inside the block and resolves the last group
+        // with one vector compare
+        void seek(uint32_t target) {
+            if (!valid() || docs_[pos_] >= target) {
+                return;
+            }
+            if (docs_[count_ - 1] < target) {
+                size_t n = list_.blocks();
+                size_t lo = block_, step = 1;
+                while (lo + step < n && list_.last_doc(lo + step) < target) {
+                    lo += step;
+                    step <<= 1;
+                }
+                size_t hi = std::min(lo + step, n);
+                while (hi - lo > 1) {
+                    size_t mid = lo + (hi - lo) / 2;
+                    if (list_.last_doc(mid) < target) {
+                        lo = mid;
+                    } else {
+                        hi = mid;
+                    }
+                }
+                if (!load(hi)) {
+                    return;
+                }
+            }
+            size_t lo = pos_, step = 8;
+            while (lo + step <= count_ && docs_[lo + step - 1] < target) {
+                lo += step;
+                step <<= 1;
+            }
+            size_t hi = std::min(lo + step, count_);
+            while (hi - lo > 8) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (docs_[mid - 1] < target) {
+                    lo = mid;
+                } else {
+                    hi = mid;
+                }
+            }
+            pos_ = lo + count_less(docs_ + lo, target);
+        }
+
+    private:
+        const PostingList &list_;
+        size_t block_;
+        size_t pos_;
+        size_t count_;
+        // padded with UINT32_MAX so an 8-wide compare may run past the last id
+        uint32_t docs_[kBlockSize + 8];
+
+        bool load(size_t block) {
+            block_ = block;
+            pos_ = 0;
+            count_ = block < list_.blocks() ? list_.decode(block, docs_) : 0;
+            return count_ != 0;
+        }
+
+        // ids in p[0..8) below target; the ids past the window are all >= target
+#if defined(__SSE2__)
+        static size_t count_less(const uint32_t *p, uint32_t target) {
+            // SSE2 only compares signed lanes; flipping the sign bit orders unsigned ids the same way
+            const __m128i bias = _mm_set1_epi32(INT32_MIN);
+            __m128i t = _mm_xor_si128(_mm_set1_epi32(int32_t(target)), bias);
+            __m128i a = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), bias);
+            __m128i b = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 4)), bias);
+            int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(a, t)))
+                | _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(b, t))) << 4;
+            return __builtin_popcount(mask);
+        }
+#else
+        static size_t count_less(const uint32_t *p, uint32_t target) {
+            size_t n = 0;
+            for (size_t i = 0; i < 8; i++) {
+                n += p[i] < target;
+            }
+            return n;
+        }
+#endif
+    };
+
+    PostingList(): packed_(1, 0), size_(0) {}
+
+    // whether append(doc) would succeed
+    bool accepts(uint32_t doc) const {
+        return size_ == 0 || doc >= last();
+    }
+
+    // docs must arrive in increasing order; a repeat of the last doc is ignored
+    int append(uint32_t doc) {
+        if (size_ != 0) {
+            if (doc == last()) {
+                return 0;
+            }
+            if (doc < last()) {
+                return -1;
+            }
+        }
+        tail_.push_back(doc);
+        size_++;
+        if (tail_.size() == kBlockSize) {
+            seal();
+        }
+        return 0;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    // the largest doc listed; the list must not be empty
+    uint32_t last() const {
+        return tail_.empty() ? skips_.back().last : tail_.back();
+    }
+
+    size_t memory_usage() const {
+        return skips_.capacity() * sizeof(Skip) + packed_.capacity() * sizeof(uint32_t)
+            + tail_.capacity() * sizeof(uint32_t);
+    }
+
+private:
+    struct Skip {
+        uint32_t first;
+        uint32_t last;
+        uint32_t offset;    // into packed_
+        uint8_t bits;
+        uint8_t count;
+    };
+
+    std::vector<Skip> skips_;
+    std::vector<uint32_t> packed_;    // ends in a spare word so decode may read 64 bits anywhere
+    std::vector<uint32_t> tail_;
+    size_t size_;
+
+    // sealed blocks, plus the open tail
+    size_t blocks() const {
+        return skips_.size() + (tail_.empty() ? 0 : 1);
+    }
+
+    uint32_t last_doc(size_t block) const {
+        return block < skips_.size() ? skips_[block].last : tail_.back();
+    }
+
+    void seal() {
+        uint32_t widest = 0;
+        for (size_t i = 1; i < tail_.size(); i++) {
+            widest |= tail_[i] - tail_[i - 1] - 1;
+        }
+        uint8_t bits = widest == 0 ? 0 : uint8_t(32 - __builtin_clz(widest));
+        packed_.pop_back();
+        skips_.push_back(Skip{tail_.front(), tail_.back(), uint32_t(packed_.size()), bits, uint8_t(tail_.size())});
+        uint64_t acc = 0;
+        unsigned have = 0;
+        for (size_t i = 1; i < tail_.size(); i++) {
+            acc |= uint64_t(tail_[i] - tail_[i - 1] - 1) << have;
+            have += bits;
+            if (have >= 32) {
+                packed_.push_back(uint32_t(acc));
+                acc >>= 32;
+                have -= 32;
+            }
+        }
+        if (have != 0) {
+            packed_.push_back(uint32_t(acc));
+        }
+        packed_.push_back(0);
+        tail_.clear();
+    }
+
+#if defined(__SSE2__)
+    // in-register scan of 4 lanes at a time, carrying the last lane into the next group
+    static void prefix_sum(uint32_t *p, size_t count) {
+        __m128i carry = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+            x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+            x = _mm_add_epi32(x, carry);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p + i), x);
+            carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+        }
+        for (; i < count; i++) {
+            p[i] += i == 0 ? 0 : p[i - 1];
+        }
+    }
+#else
+    static void prefix_sum(uint32_t *p, size_t count) {
+        for (size_t i = 1; i < count; i++) {
+            p[i] += p[i - 1];
+        }
+    }
+#endif
+
+    // fills out with the ids of a block, pads it for count_less and returns the count
+    size_t decode(size_t block, uint32_t *out) const {
+        size_t count;
+        if (block == skips_.size()) {
+            count = tail_.size();
+            std::memcpy(out, tail_.data(), count * sizeof(uint32_t));
+        } else {
+            const Skip &skip = skips_[block];
+            const uint32_t *in = packed_.data() + skip.offset;
+            // out may alias the skip table as far as the compiler knows; keep the loop in locals
+            unsigned bits = skip.bits;
+            uint64_t mask = (uint64_t(1) << bits) - 1;
+            count = skip.count;
+            out[0] = skip.first;
+            // a run of consecutive ids packs to no words at all
+            if (bits == 0) {
+                for (size_t i = 1; i < count; i++) {
+                    out[i] = skip.first + uint32_t(i);
+                }
+                for (size_t i = count; i < count + 8; i++) {
+                    out[i] = UINT32_MAX;
+                }
+                return count;
+            }
+            // every gap is read from its own 64-bit window, so the unpacking has no serial
+            // dependency; the running sum is a separate pass
+            for (size_t i = 1; i < count; i++) {
+                size_t bit = (i - 1) * bits;
+                uint64_t window;
+                std::memcpy(&window, in + bit / 32, sizeof(window));
+                out[i] = uint32_t((window >> (bit % 32)) & mask) + 1;
+            }
+            prefix_sum(out, count);
+        }
+        for (size_t i = count; i < count + 8; i++) {
+            out[i] = UINT32_MAX;
+        }
+        return count;
+    }
+};
+
+// keyword id -> posting list. lists are indexed by the dense keyword id and remember the
+// generation they were built for, so a keyword the table evicted and whose id went to another
+// keyword starts an empty list instead of inheriting the old postings.
+// a keyword is pinned in its table when its list is started, so a bounded table never evicts a
+// keyword the index holds postings for.
+// documents are added in increasing id order by a single writer; search() may then run from
+// any number of threads.
+class InvertedIndex {
+public:
+    explicit InvertedIndex(FlyWeight &keywords): keywords_(keywords), documents_(0) {}
+
+    // adds all of the document's postings or none: returns -1, leaving the index as it was, if
+    // doc does not come after a doc already listed under one of its keywords, or a keyword was
+    // evicted from the table since its handle was taken (a keyword pinned on the way stays pinned)
+    int add_document(uint32_t doc, const std::vector<Keyword> &keywords) {
+        for (auto &keyword: keywords) {
+            if (keyword.id == kInvalidKeyword) {
+                continue;
+            }
+            if (keyword.id < lists_.size() && lists_[keyword.id].generation == keyword.generation
+                && lists_[keyword.id].postings.size() != 0) {
+                if (!lists_[keyword.id].postings.accepts(doc)) {
+                    return -1;
+                }
+            } else if (keywords_.pin(keyword) != 0) {
+                return -1;
+            }
+        }
+        for (auto &keyword: keywords) {
+            if (keyword.id == kInvalidKeyword) {
+                continue;
+            }
+            if (keyword.id >= lists_.size()) {
+                lists_.resize(size_t(keyword.id) + 1);
+            }
+            Entry &entry = lists_[keyword.id];
+            if (entry.generation != keyword.generation) {
+                entry.generation = keyword.generation;
+                entry.postings = PostingList();
+            }
+            entry.postings.append(doc);
+        }
+        documents_++;
+        return 0;
+    }
+
+    // docs containing every keyword, in increasing order. the shortest list leads and every
+    // other list, shortest first, gallops to its candidates, so the work follows the rarest term
+    int search(const std::vector<Keyword> &keywords, std::vector<uint32_t> &docs) const {
+        docs.clear();
+        std::vector<const PostingList*> lists;
+        for (auto &keyword: keywords) {
+            const PostingList *list = find(keyword);
+            if (list == nullptr) {
+                return 0;
+            }
+            lists.push_back(list);
+        }
+        if (lists.empty()) {
             return 0;
         }
-        return -1;
+        std::sort(lists.begin(), lists.end(), [](const PostingList *a, const PostingList *b) {
+            return a->size() < b->size();
+        });
+
+        std::vector<PostingList::Cursor> cursors;
+        cursors.reserve(lists.size());
+        for (auto list: lists) {
+            cursors.emplace_back(*list);
+        }
+        PostingList::Cursor &lead = cursors[0];
+        while (lead.valid()) {
+            uint32_t target = lead.doc();
+            size_t i = 1;
+            for (; i < cursors.size(); i++) {
+                cursors[i].seek(target);
+                if (!cursors[i].valid()) {
+                    return 0;
+                }
+                if (cursors[i].doc() != target) {
+                    break;
+                }
+            }
+            if (i == cursors.size()) {
+                docs.push_back(target);
+                lead.next();
+            } else {
+                lead.seek(cursors[i].doc());
+            }
+        }
+        return 0;
+    }
+
+    size_t documents() const {
+        return documents_;
+    }
+
+    size_t memory_usage() const {
+        size_t bytes = lists_.capacity() * sizeof(Entry);
+        for (auto &entry: lists_) {
+            bytes += entry.postings.memory_usage();
+        }
+        return bytes;
+    }
+
+private:
+    struct Entry {
+        uint32_t generation = 0;
+        PostingList postings;
+    };
+
+    FlyWeight &keywords_;
+    std::vector<Entry> lists_;
+    size_t documents_;
+
+    const PostingList* find(Keyword keyword) const {
+        if (keyword.id >= lists_.size() || lists_[keyword.id].generation != keyword.generation
+            || lists_[keyword.id].postings.size() == 0) {
+            return nullptr;
+        }
+        return &lists_[keyword.id].postings;
     }
 };
 
-std::string do_search(FlyWeight &obj_cache, std::vector<Keyword*> keywords) {
+std::string do_search(FlyWeight &obj_cache, const InvertedIndex &index, const std::vector<Keyword> &keywords) {
     std::cout << " searching for: ";
     for (auto keyword: keywords) {
         std::string key;
         obj_cache.get_key(keyword, key);
         std::cout << key << " ";
     }
-    std::cout << std::endl;
-    return "results: too many";
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint32_t> docs;
+    index.search(keywords, docs);
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    std::cout << "(" << elapsed.count() << "us)" << std::endl;
+
+    std::string results = "results: " + std::to_string(docs.size()) + " docs";
+    for (size_t i = 0; i < docs.size() && i < 5; i++) {
+        results += (i == 0 ? " - " : ", ") + std::to_string(docs[i]);
+    }
+    return results;
 }
 
 int main()
@@ -89,11 +1006,40 @@ int main()
     auto football = obj_cache.get_keyword("football");
     auto worldcup = obj_cache.get_keyword("worldcup");
 
+    // the search engine's corpus: every 3rd doc mentions football, every 5th worldcup
+    // and every 1000th the final; the "live" coverage is one unbroken run of docs
+    InvertedIndex index(obj_cache);
+    auto final = obj_cache.get_keyword("final");
+    auto live = obj_cache.get_keyword("live");
+    for (uint32_t doc = 0; doc < 4000000; doc++) {
+        std::vector<Keyword> terms;
+        if (doc % 3 == 0) {
+            terms.push_back(football);
+        }
+        if (doc % 5 == 0) {
+            terms.push_back(worldcup);
+        }
+        if (doc % 1000 == 10) {
+            terms.push_back(final);
+        }
+        if (doc >= 1000000 && doc < 1500000) {
+            terms.push_back(live);
+        }
+        index.add_document(doc, terms);
+    }
+    std::cout << "indexed " << index.documents() << " docs in " << index.memory_usage() << " bytes" << std::endl;
+    // an out of order doc is rejected whole: the new "replay" would take it, "final" cannot
+    auto replay = obj_cache.get_keyword("replay");
+    int rejected = index.add_document(3000000, {replay, final});
+    std::vector<uint32_t> replays;
+    index.search({replay}, replays);
+    std::cout << "out of order doc rejected: " << (rejected != 0) << ", docs with replay: " << replays.size() << std::endl;
+
     // send to search engine
-    std::vector<Keyword *> keywords;
+    std::vector<Keyword> keywords;
     keywords.push_back(football);
     keywords.push_back(worldcup);
-    do_search(obj_cache, keywords);
+    std::cout << do_search(obj_cache, index, keywords) << std::endl;
 
     keywords.resize(0);
     // search #2: "worldcup football"
@@ -102,9 +1048,59 @@ int main()
     keywords.push_back(worldcup2);
     keywords.push_back(football2);
     
-    do_search(obj_cache, keywords);
+    std::cout << do_search(obj_cache, index, keywords) << std::endl;
+
+    // search #3: "worldcup final" - the rare term leads and the common one only gallops to its docs
+    keywords.resize(0);
+    keywords.push_back(worldcup);
+    keywords.push_back(final);
+    std::cout << do_search(obj_cache, index, keywords) << std::endl;
+
+    // search #4: "live final" - a list of consecutive docs, whose blocks compress to no bits at all
+    keywords.resize(0);
+    keywords.push_back(live);
+    keywords.push_back(final);
+    std::cout << do_search(obj_cache, index, keywords) << std::endl;
     
     // both the searches use the same copy of two keywords - "worldcup" and "football"
+    std::cout << "football: " << football.id << " / " << football2.id
+              << ", worldcup: " << worldcup.id << " / " << worldcup2.id << std::endl;
+
+    // many query threads interning overlapping tokens agree on one id per keyword
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&obj_cache, t]() {
+            for (int i = 0; i < 50000; i++) {
+                obj_cache.get_keyword("token-" + std::to_string((i * 7 + t) % 20000));
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    Keyword token = {kInvalidKeyword, 0};
+    std::string key;
+    obj_cache.find("token-1234", token);
+    obj_cache.get_key(token, key);
+    std::cout << "interned " << obj_cache.size() << " keywords in "
+              << obj_cache.memory_usage() << " bytes; " << key << " -> " << token.id << std::endl;
+
+    // a bounded table: the sweeper evicts tokens that went cold, and a handle to one of
+    // them is detected as stale rather than resolving to whichever keyword reused its id
+    // a keyword with postings in an index is pinned and survives the sweep
+    FlyWeight bounded(512 * 1024);
+    InvertedIndex bounded_index(bounded);
+    Keyword indexed = bounded.get_keyword("indexed-once");
+    bounded_index.add_document(0, {indexed});
+    Keyword cold = bounded.get_keyword("once-seen");
+    for (int i = 0; i < 200000; i++) {
+        bounded.get_keyword("hot-" + std::to_string(i % 100));
+        bounded.get_keyword("long-tail-" + std::to_string(i));
+    }
+    std::cout << "bounded: " << bounded.size() << " keywords in " << bounded.memory_usage()
+              << " bytes after " << bounded.evictions() << " evictions; \"once-seen\" is "
+              << (bounded.get_key(cold, key) == 0 ? "live" : "stale") << ", \"indexed-once\" is "
+              << (bounded.get_key(indexed, key) == 0 ? "live" : "stale") << std::endl;
 
     return 0;
 }